@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include "run.h"
+#include <errno.h>
+#include <fcntl.h>
+
+/* Access log. A loop only copies a fixed-size record into its own ring;
+ * one writer thread formats every ring's records and writes them out in
+ * batches. When a ring is full the line is dropped and counted, so a slow
+ * disk or pipe never holds up a request. */
+
+// Records per worker, a power of two
+#define LW_LOG_RING 2048
+
+// Bytes formatted before each write()
+#define LW_LOG_BATCH (64 * 1024)
+
+// How long the writer sleeps when every ring is empty, in milliseconds
+#define LW_LOG_IDLE_MS 20
+
+/* Single producer (the loop), single consumer (the writer). head and tail
+ * only ever grow; each sits on its own cache line. */
+struct lw_log_ring {
+    uint64_t head;
+    char pad1[56];
+    uint64_t tail;
+    char pad2[56];
+    uint64_t dropped;           /* written by the loop */
+    uint64_t reported;          /* drops already logged, writer only */
+    struct lw_log_ring *next;
+    lw_log_record_t records[LW_LOG_RING];
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    lw_log_ring_t *rings;       /* live as long as the process */
+    int fd;
+    int started;
+    int stop;                   /* finish what is queued, then return */
+    pthread_t thread;
+} writer = { .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+lw_log_record_t *lw_log_reserve(lw_log_ring_t *ring) {
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LW_LOG_RING) {
+        lw_metric_add(&ring->dropped, 1);
+        return NULL;
+    }
+    return &ring->records[head & (LW_LOG_RING - 1)];
+}
+
+// Publishes the record lw_log_reserve handed out
+void lw_log_commit(lw_log_ring_t *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Quotes and control bytes would break either format
+static size_t put_escaped(char *out, size_t size, const char *s) {
+    size_t n = 0;
+    for (; *s && n + 7 < size; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            n += snprintf(out + n, size - n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static size_t format_record(char *out, size_t size, const lw_log_record_t *rec) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->addr, ip, sizeof(ip));
+
+    char path[sizeof(rec->path) * 6 + 1];
+    put_escaped(path, sizeof(path), rec->path);
+    const char *method = rec->method < UNKNOWN ? method_to_string(rec->method) : "-";
+
+    struct tm tm;
+    char when[40];
+    if (LW_LOG_FORMAT == LW_LOG_JSON) {
+        gmtime_r(&rec->time, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        return snprintf(out, size,
+                        "{\"time\":\"%s\",\"ip\":\"%s\",\"method\":\"%s\",\"path\":\"%s\","
+                        "\"version\":\"1.%d\",\"status\":%d,\"bytes\":%llu,\"latency_us\":%u}\n",
+                        when, ip, method, path, rec->version_minor, rec->status,
+                        (unsigned long long)rec->bytes, rec->latency_us);
+    }
+
+    // Common log format, with the latency in microseconds appended like Apache's %D
+    localtime_r(&rec->time, &tm);
+    strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    size_t n = snprintf(out, size, "%s - - [%s] ", ip, when);
+    if (rec->method < UNKNOWN)
+        n += snprintf(out + n, size - n, "\"%s %s HTTP/1.%d\"", method, path, rec->version_minor);
+    else
+        n += snprintf(out + n, size - n, "\"-\"");
+    return n + snprintf(out + n, size - n, " %d %llu %u\n", rec->status,
+                        (unsigned long long)rec->bytes, rec->latency_us);
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(writer.fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;     // nowhere to report it
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    char *batch = malloc(LW_LOG_BATCH);
+    if (!batch) return NULL;
+    const size_t line_max = 2048;
+
+    for (;;) {
+        size_t len = 0;
+        int drained = 0;
+
+        pthread_mutex_lock(&writer.mutex);
+        lw_log_ring_t *rings = writer.rings;
+        pthread_mutex_unlock(&writer.mutex);
+
+        for (lw_log_ring_t *ring = rings; ring; ring = ring->next) {
+            uint64_t tail = ring->tail;
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+            for (; tail != head; tail++) {
+                if (len + line_max > LW_LOG_BATCH) {
+                    write_all(batch, len);
+                    len = 0;
+                }
+                len += format_record(batch + len, LW_LOG_BATCH - len,
+                                     &ring->records[tail & (LW_LOG_RING - 1)]);
+                drained++;
+            }
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+            uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            if (dropped != ring->reported) {
+                len += snprintf(batch + len, LW_LOG_BATCH - len,
+                                "[LOG] %llu access log lines dropped, the log cannot keep up\n",
+                                (unsigned long long)(dropped - ring->reported));
+                ring->reported = dropped;
+            }
+        }
+
+        if (len) write_all(batch, len);
+        if (!drained) {
+            if (__atomic_load_n(&writer.stop, __ATOMIC_ACQUIRE)) break;
+            struct timespec idle = { 0, LW_LOG_IDLE_MS * 1000000L };
+            nanosleep(&idle, NULL);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+/* Opens LW_ACCESS_LOG ("-" is stdout, "off" disables the log) and starts
+ * the writer. Call once before the loops are set up. */
+int lw_access_log_start(void) {
+    if (!LW_ACCESS_LOG || strcmp(LW_ACCESS_LOG, "off") == 0) return 0;
+
+    if (strcmp(LW_ACCESS_LOG, "-") == 0) {
+        // Keeps the server's own messages from splitting log lines
+        fflush(stdout);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        writer.fd = STDOUT_FILENO;
+    } else {
+        writer.fd = open(LW_ACCESS_LOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (writer.fd < 0) {
+            perror("[ERR] Could not open access log");
+            return -1;
+        }
+    }
+
+    if (pthread_create(&writer.thread, NULL, writer_main, NULL) != 0) {
+        perror("[ERR] Could not create access log thread");
+        return -1;
+    }
+    writer.started = 1;
+    return 0;
+}
+
+// Writes out every line queued so far and stops the writer; for shutdown
+void lw_access_log_stop(void) {
+    if (!writer.started) return;
+    __atomic_store_n(&writer.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(writer.thread, NULL);
+    writer.started = 0;
+}
+
+// Gives loop a ring of its own, or none when the log is off
+int lw_log_loop_init(lw_loop_t *loop) {
+    loop->log = NULL;
+    if (!writer.started) return 0;
+
+    lw_log_ring_t *ring = calloc(1, sizeof(*ring));
+    if (!ring) return -1;
+
+    pthread_mutex_lock(&writer.mutex);
+    ring->next = writer.rings;
+    writer.rings = ring;
+    pthread_mutex_unlock(&writer.mutex);
+    loop->log = ring;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "run.h"
+#include <stdint.h>
+
+/* Request and response memory comes from here and is dropped all at
+ * once when the connection is done with the request, instead of one
+ * free() per header. */
+#define LW_ARENA_BLOCK (16 * 1024)
+
+/* Bigger allocations get their own block so they don't waste the tail
+ * of the current one. */
+#define LW_ARENA_LARGE (LW_ARENA_BLOCK / 4)
+
+#define LW_ARENA_ALIGN 16
+
+static lw_arena_block_t *block_new(size_t cap) {
+    lw_arena_block_t *block = malloc(sizeof(*block) + cap);
+    if (!block) return NULL;
+    block->next = NULL;
+    block->used = 0;
+    block->cap = cap;
+    return block;
+}
+
+// Carves n bytes out of block, or returns NULL if they don't fit
+static void *block_take(lw_arena_block_t *block, size_t n) {
+    uintptr_t base = (uintptr_t)block->data;
+    uintptr_t at = (base + block->used + LW_ARENA_ALIGN - 1) & ~(uintptr_t)(LW_ARENA_ALIGN - 1);
+    if (at - base + n > block->cap) return NULL;
+    block->used = at - base + n;
+    return (void *)at;
+}
+
+void *lw_arena_alloc(lw_arena_t *arena, size_t n) {
+    if (n == 0) n = 1;
+
+    if (n > LW_ARENA_LARGE) {
+        lw_arena_block_t *large = block_new(n + LW_ARENA_ALIGN);
+        if (!large) return NULL;
+        large->next = arena->large;
+        arena->large = large;
+        return block_take(large, n);
+    }
+
+    void *p = arena->block ? block_take(arena->block, n) : NULL;
+    if (p) return p;
+
+    lw_arena_block_t *block = block_new(LW_ARENA_BLOCK);
+    if (!block) return NULL;
+    block->next = arena->block;
+    arena->block = block;
+    return block_take(block, n);
+}
+
+char *lw_arena_strdup(lw_arena_t *arena, const char *s) {
+    size_t len = strlen(s);
+    char *copy = lw_arena_alloc(arena, len + 1);
+    if (copy) memcpy(copy, s, len + 1);
+    return copy;
+}
+
+/* Forgets every allocation. The first block is kept for the next
+ * request; anything a big request needed on top goes back to malloc. */
+void lw_arena_reset(lw_arena_t *arena) {
+    while (arena->large) {
+        lw_arena_block_t *next = arena->large->next;
+        free(arena->large);
+        arena->large = next;
+    }
+
+    while (arena->block && arena->block->next) {
+        lw_arena_block_t *next = arena->block->next;
+        free(arena->block);
+        arena->block = next;
+    }
+    if (arena->block) arena->block->used = 0;
+}
+
+void lw_arena_free(lw_arena_t *arena) {
+    lw_arena_reset(arena);
+    free(arena->block);
+    arena->block = NULL;
+}
+
+/* Memory that lives as long as the request: it is released with the
+ * rest of the request, never free() it. NULL outside the event loop. */
+void *lw_alloc(http_request_t *request, size_t n) {
+    return request->arena ? lw_arena_alloc(request->arena, n) : NULL;
+}
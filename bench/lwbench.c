@@ -0,0 +1,744 @@
+/* lwbench.c - end-to-end load generator for lwserver.
+ *
+ *   make -s bench > before.json             every scenario, JSON on stdout
+ *   make -s bench BENCH_ARGS="-d 10 tls"    some of them, for longer
+ *   build/lwbench -u http://127.0.0.1:8080/css/style.css -c 128
+ *
+ * Each thread runs its own epoll loop over its share of the connections
+ * and keeps a latency histogram; they are merged when the run is over.
+ * Without -u every scenario starts its own lwserver on a free loopback
+ * port, from the current directory so it finds ./public. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#define MAX_PIPELINE 64
+#define MAX_STATUS   600
+#define MAX_EVENTS   256
+
+/* Latency histogram in nanoseconds: log-linear with HIST_SUB buckets per
+ * power of two, so every quantile is within about 3% of the real value. */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (HIST_SUB * 40)
+
+typedef struct {
+    const char *name;
+    const char *path;
+    const char *headers;        /* extra request headers, each ending in \r\n */
+    const char *server_args[3]; /* appended to the lwserver command line */
+    int tls;
+    int close;                  /* one request per connection */
+    int pipeline;               /* requests in flight per connection */
+    const char *head_path;      /* set: each request is a HEAD of this, then the GET */
+    const char *nonzero;        /* set: this /__lw/metrics counter must be above 0 after the run */
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "css",        "/css/style.css", "", {0}, 0, 0, 1, NULL, NULL },
+    { "js",         "/js/app.js",     "", {0}, 0, 0, 1, NULL, NULL },
+    { "html",       "/",              "", {0}, 0, 0, 1, NULL, NULL },
+    { "not-found",  "/css/missing.css", "", {0}, 0, 0, 1, NULL, NULL },
+    { "compressed", "/css/style.css", "Accept-Encoding: gzip, deflate, br, zstd\r\n", { "-c" }, 0, 0, 1, NULL, NULL },
+    { "close",      "/css/style.css", "", {0}, 0, 1, 1, NULL, NULL },
+    { "pipelined",  "/css/style.css", "", {0}, 0, 0, 16, NULL, NULL },
+    { "zstd-cached", "/css/style.css", "Accept-Encoding: zstd\r\n", { "-c", "-mt", "/__lw/metrics" }, 0, 0, 1,
+      NULL, "lw_compress_input_bytes_total" },
+    { "head-get",   "/css/style.css", "", {0}, 0, 0, 8, "/", NULL },
+    { "tls",        "/css/style.css", "", {0}, 1, 0, 1, NULL, NULL },
+    { "tls-close",  "/css/style.css", "", {0}, 1, 1, 1, NULL, NULL },
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+enum { CONN_CONNECTING, CONN_HANDSHAKE, CONN_OPEN };
+
+typedef struct {
+    int      fd;
+    SSL     *ssl;
+    int      state;
+    int      sent_total;        /* requests written on this connection */
+    char    *in;
+    size_t   in_len, in_cap;
+    char    *out;
+    size_t   out_len, out_off;
+    uint64_t opened;            /* connect start, when the first request began */
+    uint64_t sent[MAX_PIPELINE];
+    int      first, inflight;   /* ring of send times of unanswered requests */
+    int      head_done;         /* HEAD half of the current request answered */
+} conn_t;
+
+typedef struct {
+    pthread_t thread;
+    int       epoll_fd;
+    int       conn_count;
+    conn_t   *conns;
+    uint64_t  hist[HIST_BUCKETS];
+    uint64_t  max_ns;
+    uint64_t  requests, errors, bytes;
+    uint64_t  status[MAX_STATUS];
+} worker_t;
+
+// The run every thread works on
+static struct {
+    struct sockaddr_in addr;
+    SSL_CTX *ssl_ctx;
+    char    *request;
+    size_t   request_len;
+    int      close;
+    int      pipeline;
+    int      head_pairs;        /* requests go out as HEAD + GET */
+    uint64_t record_from;       /* end of the warmup */
+    uint64_t stop_at;
+} run;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns < HIST_SUB) return (int)ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    int bucket = (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Smallest value that no longer falls into bucket
+static uint64_t hist_upper(int bucket) {
+    if (bucket < HIST_SUB) return bucket + 1;
+    int exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t step = 1ull << (exp - HIST_SUB_BITS);
+    return (HIST_SUB + bucket % HIST_SUB) * step + step;
+}
+
+// Upper bound of the bucket holding the q-th value in microseconds, at most max_ns
+static double hist_quantile(const uint64_t *hist, uint64_t total, uint64_t max_ns, double q) {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    int i = 0;
+    for (; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) break;
+    }
+    uint64_t upper = hist_upper(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+    return (upper < max_ns ? upper : max_ns) / 1e3;
+}
+
+/* Length of the first complete response in buf, 0 if more bytes are
+ * needed, -1 if it is not HTTP. eof: the peer closed after buf;
+ * head_only: it answers a HEAD, nothing follows whatever it says. */
+static long response_length(const char *buf, size_t len, int eof, int head_only, int *status, int *close) {
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!end) return eof ? -1 : 0;
+    size_t head = end + 4 - buf;
+    if (head < 12 || memcmp(buf, "HTTP/1.", 7) != 0) return -1;
+
+    *status = atoi(buf + 9);
+    *close = buf[7] == '0';
+    long content_length = -1;
+    int chunked = 0;
+
+    for (const char *line = memchr(buf, '\n', head) + 1; line < end; line = memchr(line, '\n', end + 2 - line) + 1) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = atol(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = memmem(line, end + 2 - line, "chunked", 7) != NULL;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = line + 11;
+            while (*value == ' ') value++;
+            if (strncasecmp(value, "close", 5) == 0) *close = 1;
+            else if (strncasecmp(value, "keep-alive", 10) == 0) *close = 0;
+        }
+    }
+
+    if (head_only || *status < 200 || *status == 204 || *status == 304) return head;
+    if (content_length >= 0) return head + content_length <= len ? (long)(head + content_length) : 0;
+    if (!chunked) {
+        // Delimited by the connection closing
+        *close = 1;
+        return eof ? (long)len : 0;
+    }
+
+    size_t pos = head;
+    for (;;) {
+        const char *line_end = memmem(buf + pos, len - pos, "\r\n", 2);
+        if (!line_end) return eof ? -1 : 0;
+        size_t size = strtoul(buf + pos, NULL, 16);
+        pos = line_end + 2 - buf;
+        if (size == 0) return pos + 2 <= len ? (long)(pos + 2) : (eof ? -1 : 0);
+        pos += size + 2;
+        if (pos > len) return eof ? -1 : 0;
+    }
+}
+
+static void conn_open(worker_t *w, conn_t *c);
+
+static void conn_drop(worker_t *w, conn_t *c) {
+    if (c->ssl) SSL_free(c->ssl);
+    if (c->fd >= 0) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->ssl = NULL;
+    c->fd = -1;
+    c->in_len = c->out_len = c->out_off = 0;
+    c->first = c->inflight = 0;
+    c->sent_total = 0;
+    c->head_done = 0;
+}
+
+// Replaces the connection; an error is counted if requests were lost
+static void conn_reopen(worker_t *w, conn_t *c, int failed) {
+    if (failed && now_ns() >= run.record_from) w->errors++;
+    conn_drop(w, c);
+    if (now_ns() < run.stop_at) conn_open(w, c);
+}
+
+static void conn_open(worker_t *w, conn_t *c) {
+    c->opened = now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("[ERR] socket");
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->state = CONN_CONNECTING;
+    if (connect(c->fd, (struct sockaddr *)&run.addr, sizeof(run.addr)) == 0)
+        c->state = CONN_HANDSHAKE;
+    else if (errno != EINPROGRESS) {
+        w->errors++;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+
+    if (run.ssl_ctx) {
+        c->ssl = SSL_new(run.ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_connect_state(c->ssl);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+// Returns bytes moved, 0 if the socket would block, -1 on error or close
+static ssize_t conn_io(conn_t *c, int writing, void *buf, size_t len) {
+    if (c->ssl) {
+        int n = writing ? SSL_write(c->ssl, buf, (int)len) : SSL_read(c->ssl, buf, (int)len);
+        if (n > 0) return n;
+        int err = SSL_get_error(c->ssl, n);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+    }
+    ssize_t n = writing ? send(c->fd, buf, len, MSG_NOSIGNAL) : recv(c->fd, buf, len, 0);
+    if (n > 0) return n;
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    return -1;
+}
+
+static void record(worker_t *w, conn_t *c, int status, size_t len) {
+    uint64_t sent = c->sent[c->first];
+    c->first = (c->first + 1) % MAX_PIPELINE;
+    c->inflight--;
+    if (sent < run.record_from) return;
+
+    uint64_t ns = now_ns() - sent;
+    w->hist[hist_bucket(ns)]++;
+    if (ns > w->max_ns) w->max_ns = ns;
+    w->requests++;
+    w->bytes += len;
+    if (status > 0 && status < MAX_STATUS) w->status[status]++;
+}
+
+/* Moves the connection as far as it goes without blocking: connect,
+ * handshake, keep `pipeline` requests in flight and read the answers. */
+static void conn_drive(worker_t *w, conn_t *c, uint32_t events) {
+    if (c->state == CONN_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) { conn_reopen(w, c, 1); return; }
+        c->state = CONN_HANDSHAKE;
+    }
+    if (c->state == CONN_HANDSHAKE) {
+        if (c->ssl) {
+            int rc = SSL_do_handshake(c->ssl);
+            if (rc != 1) {
+                int err = SSL_get_error(c->ssl, rc);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) conn_reopen(w, c, 1);
+                return;
+            }
+        }
+        c->state = CONN_OPEN;
+    }
+
+    for (;;) {
+        // Top up the pipeline; a closing connection carries one request
+        uint64_t now = now_ns();
+        while (c->inflight < run.pipeline && now < run.stop_at && !(run.close && c->sent_total > 0)) {
+            memcpy(c->out + c->out_len, run.request, run.request_len);
+            c->out_len += run.request_len;
+            // A fresh connection's first request also waited for the connect
+            c->sent[(c->first + c->inflight) % MAX_PIPELINE] = c->sent_total == 0 ? c->opened : now;
+            c->inflight++;
+            c->sent_total++;
+        }
+
+        while (c->out_off < c->out_len) {
+            ssize_t n = conn_io(c, 1, c->out + c->out_off, c->out_len - c->out_off);
+            if (n < 0) { conn_reopen(w, c, 1); return; }
+            if (n == 0) break;
+            c->out_off += n;
+        }
+        if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+
+        int eof = 0, progress = 0;
+        for (;;) {
+            if (c->in_cap - c->in_len < 16384) {
+                c->in_cap = c->in_cap ? c->in_cap * 2 : 65536;
+                c->in = realloc(c->in, c->in_cap);
+            }
+            ssize_t n = conn_io(c, 0, c->in + c->in_len, c->in_cap - c->in_len);
+            if (n == 0) break;
+            if (n < 0) { eof = 1; break; }
+            c->in_len += n;
+        }
+
+        while (c->inflight > 0) {
+            int status = 0, closing = 0;
+            int head = run.head_pairs && !c->head_done;
+            long len = response_length(c->in, c->in_len, eof, head, &status, &closing);
+            if (len < 0) { conn_reopen(w, c, 1); return; }
+            if (len == 0) break;
+
+            // The pair counts once, when the GET is answered
+            c->head_done = head;
+            if (!head) record(w, c, status, len);
+            memmove(c->in, c->in + len, c->in_len - len);
+            c->in_len -= len;
+            progress = 1;
+            if (closing || run.close) {
+                conn_reopen(w, c, c->inflight > 0);
+                return;
+            }
+        }
+
+        if (eof) { conn_reopen(w, c, c->inflight > 0); return; }
+        if (!progress) return;
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < w->conn_count; i++) {
+        conn_t *c = &w->conns[i];
+        c->fd = -1;
+        c->out = malloc(run.request_len * run.pipeline);
+        conn_open(w, c);
+    }
+
+    while (now_ns() < run.stop_at) {
+        int ready = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < ready; i++) {
+            conn_t *c = events[i].data.ptr;
+            if (c->fd >= 0) conn_drive(w, c, events[i].events);
+        }
+        // Connections that failed to open get another try
+        for (int i = 0; i < w->conn_count; i++)
+            if (w->conns[i].fd < 0 && now_ns() < run.stop_at) conn_open(w, &w->conns[i]);
+    }
+
+    for (int i = 0; i < w->conn_count; i++) {
+        conn_drop(w, &w->conns[i]);
+        free(w->conns[i].in);
+        free(w->conns[i].out);
+    }
+    return NULL;
+}
+
+static void print_result(const char *name, worker_t *workers, int threads, double seconds, int last) {
+    static uint64_t hist[HIST_BUCKETS];
+    static uint64_t status[MAX_STATUS];
+    uint64_t requests = 0, errors = 0, bytes = 0, max_ns = 0;
+    memset(hist, 0, sizeof(hist));
+    memset(status, 0, sizeof(status));
+
+    for (int t = 0; t < threads; t++) {
+        worker_t *w = &workers[t];
+        for (int i = 0; i < HIST_BUCKETS; i++) hist[i] += w->hist[i];
+        for (int i = 0; i < MAX_STATUS; i++) status[i] += w->status[i];
+        requests += w->requests;
+        errors += w->errors;
+        bytes += w->bytes;
+        if (w->max_ns > max_ns) max_ns = w->max_ns;
+    }
+
+    printf("    {\"scenario\": \"%s\", \"requests\": %llu, \"errors\": %llu, \"seconds\": %.2f, "
+           "\"rps\": %.0f, \"mb_per_sec\": %.2f, \"status\": {",
+           name, (unsigned long long)requests, (unsigned long long)errors, seconds,
+           requests / seconds, bytes / seconds / 1e6);
+    const char *sep = "";
+    for (int i = 0; i < MAX_STATUS; i++) {
+        if (!status[i]) continue;
+        printf("%s\"%d\": %llu", sep, i, (unsigned long long)status[i]);
+        sep = ", ";
+    }
+    printf("}, \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}%s\n",
+           hist_quantile(hist, requests, max_ns, 0.5), hist_quantile(hist, requests, max_ns, 0.9),
+           hist_quantile(hist, requests, max_ns, 0.99), hist_quantile(hist, requests, max_ns, 0.999),
+           max_ns / 1e3, last ? "" : ",");
+    fflush(stdout);
+
+    fprintf(stderr, "[BENCH] %-11s %9.0f req/s  p50 %7.1f us  p99 %7.1f us  %llu errors\n",
+            name, requests / seconds, hist_quantile(hist, requests, max_ns, 0.5),
+            hist_quantile(hist, requests, max_ns, 0.99), (unsigned long long)errors);
+}
+
+static void run_load(const char *name, int threads, int connections, double warmup, double duration, int last) {
+    worker_t *workers = calloc(threads, sizeof(*workers));
+    uint64_t start = now_ns();
+    run.record_from = start + (uint64_t)(warmup * 1e9);
+    run.stop_at = run.record_from + (uint64_t)(duration * 1e9);
+
+    for (int t = 0; t < threads; t++) {
+        worker_t *w = &workers[t];
+        w->conn_count = connections / threads + (t < connections % threads);
+        w->conns = calloc(w->conn_count ? w->conn_count : 1, sizeof(conn_t));
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        pthread_create(&w->thread, NULL, worker_main, w);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        close(workers[t].epoll_fd);
+        free(workers[t].conns);
+    }
+
+    print_result(name, workers, threads, duration, last);
+    free(workers);
+}
+
+static void build_request(const char *host, const char *path, const char *headers, int close,
+                          const char *head_path) {
+    free(run.request);
+    size_t len = strlen(host) * 2 + strlen(path) + strlen(headers) * 2 + 128 +
+                 (head_path ? strlen(head_path) : 0);
+    run.request = malloc(len);
+    run.request_len = 0;
+    run.head_pairs = head_path != NULL;
+    if (head_path)
+        run.request_len = snprintf(run.request, len, "HEAD %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                                   head_path, host, headers);
+    run.request_len += snprintf(run.request + run.request_len, len - run.request_len,
+                                "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+                                path, host, headers, close ? "Connection: close\r\n" : "");
+}
+
+// A throwaway self-signed certificate for the TLS scenarios
+static int make_cert(const char *cert_path, const char *key_path) {
+    EVP_PKEY *key = EVP_RSA_gen(2048);
+    X509 *x509 = X509_new();
+    if (!key || !x509) return -1;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 86400);
+    X509_set_pubkey(x509, key);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    X509_sign(x509, key, EVP_sha256());
+
+    FILE *cert = fopen(cert_path, "w"), *pkey = fopen(key_path, "w");
+    int rc = cert && pkey && PEM_write_X509(cert, x509) &&
+             PEM_write_PrivateKey(pkey, key, NULL, NULL, 0, NULL, NULL) ? 0 : -1;
+    if (cert) fclose(cert);
+    if (pkey) fclose(pkey);
+    X509_free(x509);
+    EVP_PKEY_free(key);
+    return rc;
+}
+
+static int free_port(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+// Starts the server and waits until it accepts connections
+static pid_t start_server(const char *binary, const scenario_t *s, int port, int workers,
+                          const char *cert, const char *key) {
+    char port_arg[16], workers_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(workers_arg, sizeof(workers_arg), "%d", workers);
+
+    const char *argv[20] = { binary, "-p", port_arg, "-w", workers_arg, "-al", "off", "-km", "1000000" };
+    int argc = 9;
+    for (int i = 0; i < 3 && s->server_args[i]; i++) argv[argc++] = s->server_args[i];
+    if (s->tls) {
+        argv[argc++] = "-ck"; argv[argc++] = cert;
+        argv[argc++] = "-pk"; argv[argc++] = key;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(binary, (char **)argv);
+        _exit(127);
+    }
+    if (pid < 0) return -1;
+
+    for (int i = 0; i < 250; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int rc = connect(fd, (struct sockaddr *)&run.addr, sizeof(run.addr));
+        close(fd);
+        if (rc == 0) return pid;
+        if (waitpid(pid, NULL, WNOHANG) == pid) break;
+        usleep(20000);
+    }
+    fprintf(stderr, "[ERR] %s did not start listening on port %d\n", binary, port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/* Reads one counter from the server's /__lw/metrics over a plain
+ * connection, -1 if it cannot. */
+static double fetch_metric(const char *name) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&run.addr, sizeof(run.addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    const char *request = "GET /__lw/metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    if (write(fd, request, strlen(request)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    static char buf[1 << 18];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    buf[len] = '\0';
+
+    // At the start of a line and followed by its value, not a # TYPE line
+    size_t name_len = strlen(name);
+    for (const char *p = strstr(buf, name); p; p = strstr(p + 1, name))
+        if (p[-1] == '\n' && p[name_len] == ' ') return strtod(p + name_len + 1, NULL);
+    return -1;
+}
+
+// Parses http[s]://host[:port][/path] into run.addr
+static int parse_url(const char *url, int *tls, char *host, size_t host_size, const char **path) {
+    *tls = strncmp(url, "https://", 8) == 0;
+    if (!*tls && strncmp(url, "http://", 7) != 0) return -1;
+    const char *p = url + (*tls ? 8 : 7);
+    size_t n = strcspn(p, ":/");
+    if (n == 0 || n >= host_size) return -1;
+    memcpy(host, p, n);
+    host[n] = '\0';
+    p += n;
+
+    int port = *tls ? 443 : 80;
+    if (*p == ':') port = (int)strtol(p + 1, (char **)&p, 10);
+    *path = *p == '/' ? p : "/";
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    run.addr = *(struct sockaddr_in *)res->ai_addr;
+    run.addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: lwbench [OPTIONS] [SCENARIO...]\n\n"
+        "Runs every scenario (or the ones named) against its own lwserver and\n"
+        "prints throughput and latency quantiles as JSON.\n\n"
+        "  -s, --server <bin>    lwserver binary to start (default: build/lwserver)\n"
+        "  -u, --url <url>       load a running server instead, http[s]://host:port/path\n"
+        "  -c <n>                connections (default: 64)\n"
+        "  -t <n>                client threads (default: half the CPUs)\n"
+        "  -sw <n>               server workers (default: half the CPUs)\n"
+        "  -d <sec>              measured seconds per scenario (default: 5)\n"
+        "  -W <sec>              warmup seconds, not measured (default: 1)\n"
+        "  -P <n>                with -u: requests in flight per connection (default: 1)\n"
+        "  -k                    with -u: one request per connection\n"
+        "  -H <header>           with -u: extra request header, repeatable\n"
+        "  -l                    list the scenarios\n");
+}
+
+int main(int argc, char **argv) {
+    const char *server = "build/lwserver", *url = NULL;
+    const char *selected[SCENARIO_COUNT];
+    int selected_count = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int half = cpus > 1 ? (int)(cpus / 2) : 1;
+    int threads = half, server_workers = half, connections = 64, pipeline = 1, close_mode = 0;
+    double duration = 5, warmup = 1;
+    char headers[2048] = "";
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        int has_value = i + 1 < argc;
+        if ((!strcmp(arg, "-s") || !strcmp(arg, "--server")) && has_value) server = argv[++i];
+        else if ((!strcmp(arg, "-u") || !strcmp(arg, "--url")) && has_value) url = argv[++i];
+        else if (!strcmp(arg, "-c") && has_value) connections = atoi(argv[++i]);
+        else if (!strcmp(arg, "-t") && has_value) threads = atoi(argv[++i]);
+        else if (!strcmp(arg, "-sw") && has_value) server_workers = atoi(argv[++i]);
+        else if (!strcmp(arg, "-d") && has_value) duration = atof(argv[++i]);
+        else if (!strcmp(arg, "-W") && has_value) warmup = atof(argv[++i]);
+        else if (!strcmp(arg, "-P") && has_value) pipeline = atoi(argv[++i]);
+        else if (!strcmp(arg, "-k")) close_mode = 1;
+        else if (!strcmp(arg, "-H") && has_value) {
+            size_t len = strlen(headers);
+            snprintf(headers + len, sizeof(headers) - len, "%s\r\n", argv[++i]);
+        } else if (!strcmp(arg, "-l")) {
+            for (size_t s = 0; s < SCENARIO_COUNT; s++) printf("%s\n", scenarios[s].name);
+            return 0;
+        } else if (arg[0] != '-' && selected_count < (int)SCENARIO_COUNT) {
+            selected[selected_count++] = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (connections < 1 || threads < 1 || duration <= 0 || pipeline < 1 || pipeline > MAX_PIPELINE) {
+        usage();
+        return 1;
+    }
+    if (threads > connections) threads = connections;
+    signal(SIGPIPE, SIG_IGN);
+
+    SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    printf("{\"threads\": %d, \"connections\": %d, \"warmup\": %.1f, \"duration\": %.1f, \"results\": [\n",
+           threads, connections, warmup, duration);
+
+    if (url) {
+        int tls;
+        char host[256];
+        const char *path;
+        if (parse_url(url, &tls, host, sizeof(host), &path) < 0) {
+            fprintf(stderr, "[ERR] Cannot use %s\n", url);
+            return 1;
+        }
+        run.ssl_ctx = tls ? ssl_ctx : NULL;
+        run.close = close_mode;
+        run.pipeline = close_mode ? 1 : pipeline;
+        build_request(host, path, headers, close_mode, NULL);
+        run_load("url", threads, connections, warmup, duration, 1);
+        printf("]}\n");
+        return 0;
+    }
+
+    char dir[] = "/tmp/lwbench.XXXXXX", cert[64], key[64];
+    if (!mkdtemp(dir)) {
+        perror("[ERR] mkdtemp");
+        return 1;
+    }
+    snprintf(cert, sizeof(cert), "%s/cert.pem", dir);
+    snprintf(key, sizeof(key), "%s/key.pem", dir);
+    int have_cert = 0, failed = 0;
+
+    // Only the scenarios that will run, so the last one closes the array
+    const scenario_t *plan[SCENARIO_COUNT];
+    int planned = 0;
+    for (size_t s = 0; s < SCENARIO_COUNT; s++) {
+        int wanted = selected_count == 0;
+        for (int i = 0; i < selected_count; i++) wanted |= !strcmp(selected[i], scenarios[s].name);
+        if (wanted) plan[planned++] = &scenarios[s];
+    }
+
+    for (int i = 0; i < planned; i++) {
+        const scenario_t *s = plan[i];
+        if (s->tls && !have_cert) {
+            if (make_cert(cert, key) < 0) {
+                fprintf(stderr, "[ERR] Could not generate a certificate\n");
+                return 1;
+            }
+            have_cert = 1;
+        }
+
+        int port = free_port();
+        run.addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(port),
+                                         .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        pid_t pid = port > 0 ? start_server(server, s, port, server_workers, cert, key) : -1;
+        if (pid < 0) {
+            failed = 1;
+            break;
+        }
+
+        run.ssl_ctx = s->tls ? ssl_ctx : NULL;
+        run.close = s->close;
+        run.pipeline = s->pipeline;
+        build_request("localhost", s->path, s->headers, s->close, s->head_path);
+        run_load(s->name, threads, connections, warmup, duration, i == planned - 1);
+
+        if (s->nonzero) {
+            double value = fetch_metric(s->nonzero);
+            if (value <= 0) {
+                fprintf(stderr, "[ERR] %s: %s is %g after the run, expected more than 0\n",
+                        s->name, s->nonzero, value);
+                failed = 1;
+            }
+        }
+
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    printf("]}\n");
+
+    if (have_cert) {
+        unlink(cert);
+        unlink(key);
+    }
+    rmdir(dir);
+    SSL_CTX_free(ssl_ctx);
+    return failed;
+}
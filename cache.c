@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include "run.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define CACHE_BUCKETS 1024
+
+/* Bigger files are cheaper to sendfile() than to keep resident. */
+#define LW_CACHE_MAX_ENTRY (1024 * 1024)
+
+/* Static variants are built once, so spend the CPU on ratio. */
+static const int variant_level[LW_ENC_COUNT] = {
+    [LW_ENC_ZSTD]   = 19,
+    [LW_ENC_BROTLI] = 11,
+    [LW_ENC_GZIP]   = 9,
+};
+
+/* Precompressed siblings on disk, e.g. app.js.zst next to app.js */
+static const char *variant_suffix[LW_ENC_COUNT] = {
+    [LW_ENC_IDENTITY] = "",
+    [LW_ENC_ZSTD]     = ".zst",
+    [LW_ENC_BROTLI]   = ".br",
+    [LW_ENC_GZIP]     = ".gz",
+};
+
+// The sibling suffix for encoding, "" for identity
+const char *lw_variant_suffix(lw_encoding_t encoding) {
+    return encoding < LW_ENC_COUNT ? variant_suffix[encoding] : "";
+}
+
+/* One cache for all workers. Lookups hold the lock only long enough to
+ * take a reference; entries stay alive until their last response is freed. */
+static struct {
+    lw_cache_entry_t *buckets[CACHE_BUCKETS];
+    lw_cache_entry_t *head, *tail;  /* LRU, most recently used first */
+    size_t used;
+    unsigned long generation;       /* bumped by every invalidation */
+    pthread_mutex_t mutex;
+    volatile int watched;           /* inotify is keeping entries fresh */
+    pthread_cond_t jobs_ready;
+    struct variant_job *jobs, *jobs_tail;   /* variants to build, oldest first */
+} cache = { .mutex = PTHREAD_MUTEX_INITIALIZER, .jobs_ready = PTHREAD_COND_INITIALIZER };
+
+/* Variants are built by one background thread so that a zstd 19 or
+ * brotli 11 pass over a large file never stalls a worker; until one is
+ * ready the identity body is served. A job holds a reference to its entry. */
+typedef struct variant_job {
+    lw_cache_entry_t *entry;
+    lw_encoding_t encoding;
+    struct variant_job *next;
+} variant_job_t;
+
+static pthread_once_t builder_once = PTHREAD_ONCE_INIT;
+static int builder_started;
+
+static unsigned hash_path(const char *path) {
+    unsigned h = 2166136261u;   // FNV-1a
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h % CACHE_BUCKETS;
+}
+
+static void entry_free(lw_cache_entry_t *entry) {
+    for (int i = 0; i < LW_ENC_COUNT; i++)
+        free(entry->variants[i].data);
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+void lw_cache_release(lw_cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        entry_free(entry);
+}
+
+static void lru_unlink(lw_cache_entry_t *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache.head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(lw_cache_entry_t *entry) {
+    entry->next = cache.head;
+    if (cache.head) cache.head->prev = entry;
+    cache.head = entry;
+    if (!cache.tail) cache.tail = entry;
+}
+
+static lw_cache_entry_t *lookup(const char *path, unsigned bucket) {
+    for (lw_cache_entry_t *e = cache.buckets[bucket]; e; e = e->hnext)
+        if (strcmp(e->path, path) == 0) return e;
+    return NULL;
+}
+
+// Drops the table's reference, caller holds the lock
+static void remove_locked(lw_cache_entry_t *entry) {
+    lw_cache_entry_t **pp = &cache.buckets[hash_path(entry->path)];
+    while (*pp != entry) pp = &(*pp)->hnext;
+    *pp = entry->hnext;
+
+    lru_unlink(entry);
+    cache.used -= entry->size;
+    for (int i = 0; i < LW_ENC_COUNT; i++)
+        cache.used -= entry->variants[i].size;
+    entry->cached = 0;
+    lw_cache_release(entry);
+}
+
+static lw_cache_entry_t *load_entry(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > LW_CACHE_MAX_ENTRY || st.st_size > LW_CACHE_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    lw_cache_entry_t *entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        close(fd);
+        return NULL;
+    }
+    entry->path = strdup(path);
+    entry->data = malloc(st.st_size + 1);
+    entry->size = st.st_size;
+    entry->mime = lw_mime_type(path);
+    entry->mtime = st.st_mtime;
+    entry->ino = st.st_ino;
+    entry->refs = 1;
+
+    size_t got = 0;
+    while (entry->path && entry->data && got < entry->size) {
+        ssize_t n = read(fd, entry->data + got, entry->size - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    if (!entry->path || !entry->data || got != entry->size) {
+        entry_free(entry);
+        return NULL;
+    }
+    entry->data[entry->size] = '\0';   // render_html treats HTML as a string
+    return entry;
+}
+
+// Without a watcher every hit is checked against the file on disk
+static int entry_stale(lw_cache_entry_t *entry) {
+    struct stat st;
+    if (stat(entry->path, &st) < 0) return 1;
+    return st.st_mtime != entry->mtime || st.st_ino != entry->ino ||
+           (size_t)st.st_size != entry->size;
+}
+
+/* Returns a referenced entry for path, loading it on a miss, or NULL when
+ * the file is missing, too large to cache, or caching is off.
+ * Pair with lw_cache_release (or hand it to lw_set_body_cached). */
+lw_cache_entry_t *lw_cache_get(const char *path) {
+    if (LW_CACHE_SIZE <= 0) return NULL;
+
+    unsigned bucket = hash_path(path);
+
+    pthread_mutex_lock(&cache.mutex);
+    lw_cache_entry_t *entry = lookup(path, bucket);
+    if (entry) {
+        lru_unlink(entry);
+        lru_push_front(entry);
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    if (entry) {
+        if (cache.watched || !entry_stale(entry)) return entry;
+
+        lw_cache_release(entry);
+        lw_cache_invalidate(path, 0);
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    unsigned long generation = cache.generation;
+    pthread_mutex_unlock(&cache.mutex);
+
+    entry = load_entry(path);
+    if (!entry) return NULL;
+
+    pthread_mutex_lock(&cache.mutex);
+    if (cache.generation != generation) {
+        // The file changed while we read it, serve this copy but don't keep it
+        pthread_mutex_unlock(&cache.mutex);
+        return entry;
+    }
+
+    lw_cache_entry_t *raced = lookup(path, bucket);
+    if (raced) {
+        // Another worker loaded it first, use theirs
+        __atomic_add_fetch(&raced->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&cache.mutex);
+        entry_free(entry);
+        return raced;
+    }
+
+    while (cache.tail && cache.used + entry->size > (size_t)LW_CACHE_SIZE)
+        remove_locked(cache.tail);
+
+    entry->hnext = cache.buckets[bucket];
+    cache.buckets[bucket] = entry;
+    lru_push_front(entry);
+    cache.used += entry->size;
+    entry->cached = 1;
+    entry->refs++;      // the table's own reference
+    pthread_mutex_unlock(&cache.mutex);
+
+    return entry;
+}
+
+/* Forgets path, or with recursive everything below it as well. */
+void lw_cache_invalidate(const char *path, int recursive) {
+    size_t len = strlen(path);
+    int removed = 0;
+
+    pthread_mutex_lock(&cache.mutex);
+    cache.generation++;
+    if (!recursive) {
+        lw_cache_entry_t *entry = lookup(path, hash_path(path));
+        if (entry) { remove_locked(entry); removed++; }
+
+        // A changed sibling like app.js.zst invalidates app.js
+        for (int i = 1; i < LW_ENC_COUNT; i++) {
+            size_t slen = strlen(variant_suffix[i]);
+            if (len <= slen || strcmp(path + len - slen, variant_suffix[i]) != 0) continue;
+
+            char base[512];
+            if (len - slen >= sizeof(base)) continue;
+            memcpy(base, path, len - slen);
+            base[len - slen] = '\0';
+            entry = lookup(base, hash_path(base));
+            if (entry) { remove_locked(entry); removed++; }
+        }
+    } else {
+        lw_cache_entry_t *entry = cache.head;
+        while (entry) {
+            lw_cache_entry_t *next = entry->next;
+            if (strncmp(entry->path, path, len) == 0 &&
+                (entry->path[len] == '\0' || entry->path[len] == '/')) {
+                remove_locked(entry);
+                removed++;
+            }
+            entry = next;
+        }
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    (LW_VERBOSE && removed) ? printf("[CACHE] Invalidated %s\n", path) : 0;
+}
+
+// A sibling only counts if it is at least as new as the file it encodes
+static char *load_sibling(const lw_cache_entry_t *entry, lw_encoding_t encoding, size_t *size) {
+    char path[512];
+    if (snprintf(path, sizeof(path), "%s%s", entry->path, variant_suffix[encoding]) >= (int)sizeof(path))
+        return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= entry->mtime &&
+        st.st_size > 0 && st.st_size <= LW_CACHE_MAX_ENTRY)
+        data = malloc(st.st_size);
+
+    size_t got = 0;
+    while (data && got < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + got, st.st_size - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    if (data && got != (size_t)st.st_size) {
+        free(data);
+        return NULL;
+    }
+    *size = got;
+    return data;
+}
+
+static char *compress_variant(const lw_cache_entry_t *entry, lw_encoding_t encoding, size_t *size) {
+    if (!lw_compressible(entry->mime) || entry->size == 0) return NULL;
+
+    lw_buf_t out = {0};
+    if (lw_compress(encoding, variant_level[encoding], entry->data, entry->size, &out) < 0 ||
+        out.len >= entry->size) {
+        lw_buf_free(&out);
+        return NULL;
+    }
+
+    char *fit = realloc(out.data, out.len);
+    *size = out.len;
+    return fit ? fit : out.data;
+}
+
+// Charges a built variant to the cache, caller holds the lock
+static void charge_locked(lw_cache_entry_t *entry, size_t size) {
+    if (!entry->cached) return;
+    cache.used += size;
+    while (cache.tail && cache.used > (size_t)LW_CACHE_SIZE)
+        remove_locked(cache.tail);
+}
+
+// From a fresh sibling file on disk or by compressing the cached bytes
+static void build_variant(lw_cache_entry_t *entry, lw_encoding_t encoding) {
+    lw_variant_t *variant = &entry->variants[encoding];
+
+    size_t size = 0;
+    char *data = load_sibling(entry, encoding, &size);
+    if (!data) {
+        uint64_t started = lw_now_ns();
+        data = compress_variant(entry, encoding, &size);
+        if (data) lw_metrics_compress(entry->size, size, lw_now_ns() - started);
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    variant->data = data;
+    variant->size = data ? size : 0;
+    __atomic_store_n(&variant->built, 1, __ATOMIC_RELEASE);
+    charge_locked(entry, variant->size);
+    pthread_mutex_unlock(&cache.mutex);
+
+    (LW_VERBOSE && data) ? printf("[CACHE] %s: %zu -> %zu bytes\n",
+                                  entry->path, entry->size, size) : 0;
+}
+
+static void *builder_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&cache.mutex);
+        while (!cache.jobs) pthread_cond_wait(&cache.jobs_ready, &cache.mutex);
+        variant_job_t *job = cache.jobs;
+        cache.jobs = job->next;
+        if (!cache.jobs) cache.jobs_tail = NULL;
+        pthread_mutex_unlock(&cache.mutex);
+
+        build_variant(job->entry, job->encoding);
+        lw_cache_release(job->entry);
+        free(job);
+    }
+    return NULL;
+}
+
+// Started from a worker, so the thread inherits its blocked signals
+static void builder_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, builder_main, NULL) != 0) {
+        perror("[ERR] Could not create cache compression thread");
+        return;
+    }
+    pthread_detach(thread);
+    builder_started = 1;
+}
+
+/* Returns 0 when entry->variants[encoding] can be served, -1 when the
+ * identity body should be sent instead. The first request for a variant
+ * of a cached entry queues it for the background builder. */
+int lw_cache_encode(lw_cache_entry_t *entry, lw_encoding_t encoding) {
+    if (encoding == LW_ENC_IDENTITY) return 0;
+    if (encoding >= LW_ENC_COUNT) return -1;
+
+    lw_variant_t *variant = &entry->variants[encoding];
+    if (__atomic_load_n(&variant->built, __ATOMIC_ACQUIRE))
+        return variant->data ? 0 : -1;
+    if (__atomic_load_n(&variant->queued, __ATOMIC_RELAXED)) return -1;
+
+    pthread_once(&builder_once, builder_start);
+    if (!builder_started) return -1;
+
+    variant_job_t *job = malloc(sizeof(*job));
+    if (!job) return -1;
+
+    pthread_mutex_lock(&cache.mutex);
+    // Entries outside the table are served once, no use building for them
+    if (variant->queued || !entry->cached) {
+        pthread_mutex_unlock(&cache.mutex);
+        free(job);
+        return -1;
+    }
+    variant->queued = 1;
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    job->entry = entry;
+    job->encoding = encoding;
+    job->next = NULL;
+    if (cache.jobs_tail) cache.jobs_tail->next = job;
+    else cache.jobs = job;
+    cache.jobs_tail = job;
+    pthread_cond_signal(&cache.jobs_ready);
+    pthread_mutex_unlock(&cache.mutex);
+    return -1;
+}
+
+void lw_cache_clear(void) {
+    pthread_mutex_lock(&cache.mutex);
+    cache.generation++;
+    while (cache.head) remove_locked(cache.head);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void lw_cache_set_watched(int watched) {
+    cache.watched = watched;
+}
@@ -0,0 +1,322 @@
+#include "run.h"
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+/* Levels for bodies compressed per request; static variants pass their own. */
+#define LW_ZSTD_LEVEL    3
+#define LW_BROTLI_LEVEL  4
+#define LW_GZIP_LEVEL    6
+
+/* Idle stream compressors kept per thread and encoding. */
+#define LW_COMPRESSOR_POOL 8
+
+struct lw_compressor {
+    lw_encoding_t encoding;
+    ZSTD_CCtx *zstd;
+    z_stream   gzip;
+    BrotliEncoderState *brotli;
+    struct lw_compressor *next;     /* free list */
+};
+
+/* Every worker owns its contexts, so none of this needs locking. */
+static __thread ZSTD_CCtx *thread_zstd;
+static __thread z_stream   thread_gzip;
+static __thread int        thread_gzip_level;
+static __thread lw_compressor_t *thread_pool[LW_ENC_COUNT];
+static __thread int        thread_pool_count[LW_ENC_COUNT];
+
+const char *lw_encoding_name(lw_encoding_t encoding) {
+    switch (encoding) {
+    case LW_ENC_ZSTD:   return "zstd";
+    case LW_ENC_BROTLI: return "br";
+    case LW_ENC_GZIP:   return "gzip";
+    default:            return "identity";
+    }
+}
+
+static lw_encoding_t encoding_from_token(const char *name, size_t len) {
+    if (len == 4 && strncasecmp(name, "zstd", 4) == 0) return LW_ENC_ZSTD;
+    if (len == 2 && strncasecmp(name, "br", 2) == 0)   return LW_ENC_BROTLI;
+    if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+        (len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) return LW_ENC_GZIP;
+    return LW_ENC_COUNT;
+}
+
+// q-values in thousandths, so "q=0.5" is 500 and a bad value counts as 0
+static int parse_qvalue(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=') return 1000;
+    p += 2;
+
+    if (p >= end || (*p != '0' && *p != '1')) return 0;
+    int q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        p++;
+        for (int scale = 100; scale > 0 && p < end && *p >= '0' && *p <= '9'; scale /= 10)
+            q += (*p++ - '0') * scale;
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+// Each encoding's weight in accept_encoding, with "*" standing in for the unnamed
+static void encoding_weights(const char *accept_encoding, int q[LW_ENC_COUNT]) {
+    int star = -1;
+    for (int i = 0; i < LW_ENC_COUNT; i++) q[i] = -1;
+
+    const char *p = accept_encoding;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = p - name;
+
+        const char *params = p;
+        while (*p && *p != ',') p++;
+        if (name_len == 0) continue;
+
+        int weight = 1000;
+        const char *semi = memchr(params, ';', p - params);
+        if (semi) weight = parse_qvalue(semi + 1, p);
+
+        if (name_len == 1 && *name == '*') {
+            star = weight;
+            continue;
+        }
+        lw_encoding_t enc = encoding_from_token(name, name_len);
+        if (enc != LW_ENC_COUNT) q[enc] = weight;
+    }
+
+    for (int enc = 0; enc < LW_ENC_COUNT; enc++)
+        if (q[enc] < 0) q[enc] = star >= 0 ? star : 0;
+}
+
+/* Fills order with every encoding the client accepts, the one it weighs
+ * highest first, and returns how many there are. Ties go to the better
+ * ratio: zstd, then brotli, then gzip. q=0 rules an encoding out. */
+int lw_rank_encodings(const char *accept_encoding, lw_encoding_t order[LW_ENC_COUNT]) {
+    if (!accept_encoding) return 0;
+
+    int q[LW_ENC_COUNT];
+    encoding_weights(accept_encoding, q);
+
+    int count = 0;
+    for (;;) {
+        lw_encoding_t best = LW_ENC_IDENTITY;
+        int best_q = 0;
+        for (int enc = LW_ENC_IDENTITY + 1; enc < LW_ENC_COUNT; enc++) {
+            if (q[enc] > best_q) {
+                best = enc;
+                best_q = q[enc];
+            }
+        }
+        if (best == LW_ENC_IDENTITY) return count;
+        order[count++] = best;
+        q[best] = 0;
+    }
+}
+
+/* Picks the encoding the client weighs highest, identity if none. */
+lw_encoding_t lw_pick_encoding(const char *accept_encoding) {
+    lw_encoding_t order[LW_ENC_COUNT];
+    return lw_rank_encodings(accept_encoding, order) ? order[0] : LW_ENC_IDENTITY;
+}
+
+/* Types worth compressing; mime may carry parameters ("; charset=..."). */
+int lw_compressible(const char *mime) {
+    static const char *types[] = {
+        "application/javascript", "application/json", "application/xml",
+        "application/vnd.ms-fontobject", "image/svg+xml", "image/x-icon",
+        "font/ttf", "font/otf",
+    };
+
+    if (!mime) return 0;
+    while (*mime == ' ') mime++;
+    if (strncasecmp(mime, "text/", 5) == 0) return 1;
+
+    size_t len = strcspn(mime, "; \t");
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (strlen(types[i]) == len && strncasecmp(mime, types[i], len) == 0) return 1;
+    return 0;
+}
+
+static int default_level(lw_encoding_t encoding) {
+    return encoding == LW_ENC_ZSTD   ? LW_ZSTD_LEVEL :
+           encoding == LW_ENC_BROTLI ? LW_BROTLI_LEVEL : LW_GZIP_LEVEL;
+}
+
+static int gzip_init(z_stream *zs, int level) {
+    memset(zs, 0, sizeof(*zs));
+    // windowBits 15 + 16 writes a gzip header and trailer instead of zlib's
+    return deflateInit2(zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+// Runs deflate until all input is consumed and `flush` is satisfied
+static int gzip_run(z_stream *zs, const void *src, size_t len, int flush, lw_buf_t *out) {
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = len;
+
+    for (;;) {
+        size_t room = deflateBound(zs, zs->avail_in) + 64;
+        if (lw_buf_reserve(out, room) < 0) return -1;
+        zs->next_out = (Bytef *)out->data + out->len;
+        zs->avail_out = out->cap - out->len;
+
+        int rc = deflate(zs, flush);
+        out->len = out->cap - zs->avail_out;
+        if (rc == Z_STREAM_ERROR) return -1;
+        if (rc == Z_STREAM_END) return 0;
+        if (zs->avail_in == 0 && zs->avail_out > 0) return 0;
+    }
+}
+
+/* Appends src compressed with `encoding` to out. level 0 picks the
+ * per-request default. Contexts are reused across calls on this thread. */
+int lw_compress(lw_encoding_t encoding, int level, const void *src, size_t len, lw_buf_t *out) {
+    if (level == 0) level = default_level(encoding);
+
+    if (encoding == LW_ENC_ZSTD) {
+        if (!thread_zstd && !(thread_zstd = ZSTD_createCCtx())) return -1;
+
+        size_t bound = ZSTD_compressBound(len);
+        if (lw_buf_reserve(out, bound) < 0) return -1;
+        size_t n = ZSTD_compressCCtx(thread_zstd, out->data + out->len, bound, src, len, level);
+        if (ZSTD_isError(n)) return -1;
+        out->len += n;
+        return 0;
+    }
+
+    if (encoding == LW_ENC_BROTLI) {
+        size_t n = BrotliEncoderMaxCompressedSize(len);
+        if (n == 0 || lw_buf_reserve(out, n) < 0) return -1;
+        if (!BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                                   len, src, &n, (uint8_t *)out->data + out->len))
+            return -1;
+        out->len += n;
+        return 0;
+    }
+
+    if (encoding == LW_ENC_GZIP) {
+        // One stream per thread, reset between bodies instead of reallocated
+        if (thread_gzip_level != level) {
+            if (thread_gzip_level) deflateEnd(&thread_gzip);
+            thread_gzip_level = 0;
+            if (gzip_init(&thread_gzip, level) < 0) return -1;
+            thread_gzip_level = level;
+        } else if (deflateReset(&thread_gzip) != Z_OK) {
+            return -1;
+        }
+        return gzip_run(&thread_gzip, src, len, Z_FINISH, out);
+    }
+
+    return -1;
+}
+
+/* Returns a stream compressor, recycled from this thread's pool when one
+ * is idle. It must be freed on the same thread. */
+lw_compressor_t *lw_compressor_new(lw_encoding_t encoding) {
+    if (encoding <= LW_ENC_IDENTITY || encoding >= LW_ENC_COUNT) return NULL;
+
+    lw_compressor_t *c = thread_pool[encoding];
+    if (c) {
+        thread_pool[encoding] = c->next;
+        thread_pool_count[encoding]--;
+        c->next = NULL;
+        return c;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->encoding = encoding;
+
+    int ok = 0;
+    if (encoding == LW_ENC_ZSTD) {
+        c->zstd = ZSTD_createCCtx();
+        ok = c->zstd &&
+             !ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, LW_ZSTD_LEVEL));
+    } else if (encoding == LW_ENC_BROTLI) {
+        c->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        ok = c->brotli && BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_QUALITY, LW_BROTLI_LEVEL);
+    } else {
+        ok = gzip_init(&c->gzip, LW_GZIP_LEVEL) == 0;
+    }
+
+    if (!ok) {
+        if (c->zstd) ZSTD_freeCCtx(c->zstd);
+        if (c->brotli) BrotliEncoderDestroyInstance(c->brotli);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static void compressor_destroy(lw_compressor_t *c) {
+    if (c->encoding == LW_ENC_ZSTD) ZSTD_freeCCtx(c->zstd);
+    else if (c->encoding == LW_ENC_BROTLI) BrotliEncoderDestroyInstance(c->brotli);
+    else deflateEnd(&c->gzip);
+    free(c);
+}
+
+void lw_compressor_free(lw_compressor_t *c) {
+    if (!c) return;
+
+    // Brotli has no reset, its state is rebuilt for the next stream
+    int reusable = thread_pool_count[c->encoding] < LW_COMPRESSOR_POOL;
+    if (reusable && c->encoding == LW_ENC_ZSTD)
+        reusable = !ZSTD_isError(ZSTD_CCtx_reset(c->zstd, ZSTD_reset_session_only));
+    else if (reusable && c->encoding == LW_ENC_GZIP)
+        reusable = deflateReset(&c->gzip) == Z_OK;
+    else
+        reusable = 0;
+
+    if (!reusable) {
+        compressor_destroy(c);
+        return;
+    }
+    c->next = thread_pool[c->encoding];
+    thread_pool[c->encoding] = c;
+    thread_pool_count[c->encoding]++;
+}
+
+/* Compresses the next piece of a stream and appends whatever output is
+ * ready to out. LW_FLUSH_SYNC pushes everything so far to the client,
+ * LW_FLUSH_END finishes the stream. Output may be empty for LW_FLUSH_NONE. */
+int lw_compressor_write(lw_compressor_t *c, const void *src, size_t len,
+                        lw_flush_t flush, lw_buf_t *out) {
+    if (c->encoding == LW_ENC_ZSTD) {
+        ZSTD_EndDirective mode = flush == LW_FLUSH_END  ? ZSTD_e_end :
+                                 flush == LW_FLUSH_SYNC ? ZSTD_e_flush : ZSTD_e_continue;
+        ZSTD_inBuffer in = { src, len, 0 };
+        for (;;) {
+            if (lw_buf_reserve(out, ZSTD_CStreamOutSize()) < 0) return -1;
+            ZSTD_outBuffer zout = { out->data + out->len, out->cap - out->len, 0 };
+            size_t left = ZSTD_compressStream2(c->zstd, &zout, &in, mode);
+            if (ZSTD_isError(left)) return -1;
+            out->len += zout.pos;
+            if (mode == ZSTD_e_continue ? in.pos == in.size : left == 0) return 0;
+        }
+    }
+
+    if (c->encoding == LW_ENC_BROTLI) {
+        BrotliEncoderOperation op = flush == LW_FLUSH_END  ? BROTLI_OPERATION_FINISH :
+                                    flush == LW_FLUSH_SYNC ? BROTLI_OPERATION_FLUSH :
+                                                             BROTLI_OPERATION_PROCESS;
+        size_t avail_in = len;
+        const uint8_t *next_in = src;
+        for (;;) {
+            if (lw_buf_reserve(out, 16384) < 0) return -1;
+            size_t avail_out = out->cap - out->len;
+            uint8_t *next_out = (uint8_t *)out->data + out->len;
+            if (!BrotliEncoderCompressStream(c->brotli, op, &avail_in, &next_in,
+                                             &avail_out, &next_out, NULL))
+                return -1;
+            out->len = out->cap - avail_out;
+            if (avail_in == 0 && !BrotliEncoderHasMoreOutput(c->brotli) &&
+                (op != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(c->brotli)))
+                return 0;
+        }
+    }
+
+    int mode = flush == LW_FLUSH_END ? Z_FINISH : flush == LW_FLUSH_SYNC ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    return gzip_run(&c->gzip, src, len, mode, out);
+}
@@ -0,0 +1,1370 @@
+#define _GNU_SOURCE
+#include "run.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define LW_MAX_EVENTS 256
+
+extern HotReloadState hot_reload_state;
+
+/* Stop dispatching pipelined requests once this much output is queued. */
+#define LW_PIPELINE_OUT_MAX (64 * 1024)
+
+/* Without kTLS, TLS cannot sendfile; file bodies go through `out` in pieces this big. */
+#define LW_FILE_CHUNK (16 * 1024)
+
+/* Bodies up to this size are copied next to their headers, bigger ones are
+ * queued as their own iovec. Keeps small responses in one TLS record too. */
+#define LW_COALESCE_MAX (8 * 1024)
+
+/* iovecs handed to one writev */
+#define LW_IOV_MAX 64
+
+/* A stream's producer is paused while this much of it is unsent. */
+#define LW_STREAM_QUEUE_MAX (64 * 1024)
+
+static void conn_release_segs(lw_conn_t *conn) {
+    for (int i = 0; i < conn->seg_count; i++)
+        lw_seg_release(&conn->segs[i]);
+    conn->seg_count = conn->seg_pos = 0;
+    conn->seg_sent = conn->seg_bytes = 0;
+}
+
+/* Queues body to go out right after what is in `out` now. Small bodies
+ * are cheaper to copy than to give their own iovec. */
+static int conn_queue_body(lw_conn_t *conn, lw_seg_t *body) {
+    if (body->len <= LW_COALESCE_MAX) {
+        int rc = body->len ? lw_buf_append(&conn->out, body->data, body->len) : 0;
+        lw_seg_release(body);
+        return rc;
+    }
+
+    if (conn->seg_count == conn->seg_cap) {
+        int cap = conn->seg_cap ? conn->seg_cap * 2 : 8;
+        lw_seg_t *segs = realloc(conn->segs, cap * sizeof(*segs));
+        if (!segs) {
+            lw_seg_release(body);
+            return -1;
+        }
+        conn->segs = segs;
+        conn->seg_cap = cap;
+    }
+
+    body->at = conn->out.len;
+    conn->segs[conn->seg_count++] = *body;
+    conn->seg_bytes += body->len;
+    return 0;
+}
+
+// Stops watching whatever a suspended handler waits on
+static void conn_wait_cancel(lw_conn_t *conn) {
+    if (!conn->wait.resume) return;
+    epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->wait.src.fd, NULL);
+    if (conn->wait.timer) close(conn->wait.src.fd);
+    conn->wait.resume = NULL;
+    conn->wait.arg = NULL;
+}
+
+/* Hands the request's access log line to the writer thread. Only what
+ * the request line holds is copied; formatting happens over there. */
+static void conn_log(lw_conn_t *conn) {
+    lw_log_ring_t *ring = conn->loop->log;
+    if (!ring) return;
+    lw_log_record_t *rec = lw_log_reserve(ring);
+    if (!rec) return;
+
+    lw_parser_t *parser = &conn->parser;
+    int head = parser->state == LW_PARSE_DONE;
+    rec->time = conn->loop->now;
+    rec->addr = conn->addr;
+    rec->latency_us = head ? (lw_now_ns() - conn->started_ns) / 1000 : 0;
+    rec->status = conn->status;
+    rec->bytes = conn->resp_bytes;
+    rec->method = head ? parser->method : UNKNOWN;
+    rec->version_minor = head ? parser->version_minor : 1;
+    if (head) {
+        const char *data = conn->in.data;
+        snprintf(rec->path, sizeof(rec->path), "%.*s%s%.*s",
+                 (int)parser->path.len, data + parser->path.off, parser->query.off ? "?" : "",
+                 (int)parser->query.len, data + parser->query.off);
+    } else {
+        strcpy(rec->path, "-");
+    }
+    lw_log_commit(ring);
+}
+
+/* Closes the socket and releases everything but the struct itself, which
+ * is freed after the current batch: later events in it may still point here. */
+static void conn_close(lw_loop_t *loop, lw_conn_t *conn) {
+    if (conn->wait.resume || (conn->stream.produce && !conn->stream.ended)) {
+        // Let the handler release its arg; the response has nowhere to go
+        lw_resume_t resume = conn->wait.resume ? conn->wait.resume : conn->stream.produce;
+        void *arg = conn->wait.resume ? conn->wait.arg : conn->stream.arg;
+        conn_wait_cancel(conn);
+        conn->stream.closed = 1;
+        resume(&conn->request, &conn->pending, LW_WAIT_ERROR, arg);
+        conn_wait_cancel(conn);
+    }
+    if (conn->state == LW_CONN_SUSPENDED || conn->stream.produce) {
+        // A stream cut short still gets its line, with what it sent so far
+        if (conn->stream.produce) conn_log(conn);
+        free_request(&conn->request);
+        free_response(&conn->pending);
+    }
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->src.fd, NULL);
+    if (conn->ssl) {
+        if (conn->state != LW_CONN_HANDSHAKE) SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    close(conn->src.fd);
+    if (conn->file_fd >= 0) close(conn->file_fd);
+    lw_compressor_free(conn->file_zc);
+    lw_compressor_free(conn->stream.zc);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+
+    conn_release_segs(conn);
+    free(conn->segs);
+    lw_arena_free(&conn->arena);
+    lw_buf_free(&conn->in);
+    lw_buf_free(&conn->out);
+    lw_timer_cancel(&loop->timers, &conn->timer);
+    if (LW_MAX_PER_IP > 0) lw_ip_release(conn->addr);
+    loop->conn_count--;
+
+    conn->dead = 1;
+    conn->next = loop->graveyard;
+    loop->graveyard = conn;
+}
+
+static lw_conn_t *conn_new(lw_loop_t *loop, int fd, struct sockaddr_in *addr) {
+    lw_conn_t *conn = calloc(1, sizeof(*conn));
+    if (!conn) return NULL;
+
+    conn->src.kind = LW_EV_CONN;
+    conn->src.fd = fd;
+    conn->state = LW_CONN_READING;
+    conn->file_fd = -1;
+    conn->loop = loop;
+    lw_parser_reset(&conn->parser);
+    conn->addr = addr->sin_addr;
+
+    if (lw_buf_reserve(&conn->in, BUFFER_SIZE) < 0) {
+        free(conn);
+        return NULL;
+    }
+
+    if (LW_SSL_ENABLED == 1) {
+        conn->ssl = SSL_new(ssl_ctx);
+        if (!conn->ssl) {
+            fprintf(stderr, "[ERR] Failed to create SSL structure\n");
+            lw_buf_free(&conn->in);
+            free(conn);
+            return NULL;
+        }
+        SSL_set_fd(conn->ssl, fd);
+        SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        conn->state = LW_CONN_HANDSHAKE;
+        conn->started_ns = lw_now_ns();
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &conn->src;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("[ERR] epoll_ctl add client failed");
+        if (conn->ssl) SSL_free(conn->ssl);
+        lw_buf_free(&conn->in);
+        free(conn);
+        return NULL;
+    }
+
+    conn->next = loop->conns;
+    if (loop->conns) loop->conns->prev = conn;
+    loop->conns = conn;
+    loop->conn_count++;
+    return conn;
+}
+
+static void conn_handshake_done(lw_conn_t *conn) {
+    lw_tls_handshake_done(conn->ssl);
+    lw_hist_record(&conn->loop->metrics->tls_handshake, (lw_now_ns() - conn->started_ns) / 1000);
+    conn->ktls = lw_tls_ktls_send(conn->ssl);
+    conn->state = LW_CONN_READING;
+}
+
+/* Reads until conn->in holds `want` bytes or the socket would block.
+ * Returns 1 if anything arrived (or EOF was seen), 0 when it would block, -1 on error. */
+static int conn_fill(lw_conn_t *conn, size_t want) {
+    lw_buf_t *in = &conn->in;
+    int progress = 0;
+
+    // Keep one spare byte so a request can be NUL-terminated in place
+    if (lw_buf_reserve(in, want + 1 - in->len) < 0)
+        return -1;
+
+    while (in->len < want) {
+        int n;
+        if (conn->ssl) {
+            n = SSL_read(conn->ssl, in->data + in->len, want - in->len);
+            if (n <= 0) {
+                int err = SSL_get_error(conn->ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return progress;
+                if (err == SSL_ERROR_ZERO_RETURN) { conn->eof = 1; return 1; }
+                return -1;
+            }
+        } else {
+            n = read(conn->src.fd, in->data + in->len, want - in->len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return progress;
+                return -1;
+            }
+            if (n == 0) { conn->eof = 1; return 1; }
+        }
+
+        in->len += n;
+        lw_metric_add(&conn->loop->metrics->bytes_in, n);
+        conn->progress = progress = 1;
+    }
+
+    return 1;
+}
+
+/* Rebuilds conn->request from the parser's offsets; `in` may have moved. */
+static http_request_t *conn_request(lw_conn_t *conn) {
+    void *user_data = conn->request.user_data;
+    lw_request_from_parser(&conn->parser, conn->in.data, &conn->request);
+    conn->request.user_data = user_data;
+    conn->request.params = conn->params.items;
+    conn->request.param_count = conn->params.count;
+    conn->request.arena = &conn->arena;
+    conn->request.conn = conn;
+    return &conn->request;
+}
+
+/* Runs once the head is parsed: picks the route and the body
+ * framing. Returns 0, or an HTTP status to reject the request with. */
+static int conn_begin_body(lw_conn_t *conn) {
+    lw_parser_t *parser = &conn->parser;
+
+    if (LW_VERBOSE) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &conn->addr, ip, sizeof(ip));
+        printf("[LW] Incoming request:\nIP: %s\n%.*s\n", ip, (int)parser->head_len, conn->in.data);
+    }
+
+    conn->started_ns = lw_now_ns();
+
+    // Queued bodies may still point into the arena, wait until they are sent
+    if (conn->out.len == 0 && conn->seg_count == 0)
+        lw_arena_reset(&conn->arena);
+
+    http_request_t *request = conn_request(conn);
+    conn->route = lw_match_route(request->method, request->path, &conn->params);
+    request->params = conn->params.items;
+    request->param_count = conn->params.count;
+    lw_body_init(&conn->body, parser);
+    conn->body_end = conn->raw_pos = parser->head_len;
+
+    int streaming = conn->route && conn->route->on_body;
+    if (!streaming && parser->content_length > LW_MAX_BODY_SIZE) return 413;
+
+    if (conn->body.framing != LW_BODY_NONE) {
+        const char *expect = lw_get_header(request, "Expect");
+        if (expect && strcasecmp(expect, "100-continue") == 0)
+            lw_buf_append(&conn->out, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
+    return 0;
+}
+
+/* Decodes whatever body bytes are buffered. Streaming routes get each piece
+ * through on_body and the bytes are dropped right away; otherwise the
+ * decoded body is compacted directly behind the head.
+ * Returns 0, or an HTTP status to reject the request with. */
+static int conn_decode_body(lw_conn_t *conn) {
+    lw_buf_t *in = &conn->in;
+    body_handler_t on_body = conn->route ? conn->route->on_body : NULL;
+
+    while (conn->body.state != LW_CHUNK_DONE && conn->raw_pos < in->len) {
+        const char *piece;
+        size_t piece_len;
+        long used = lw_body_next(&conn->body, in->data + conn->raw_pos,
+                                 in->len - conn->raw_pos, &piece, &piece_len);
+        if (used < 0) return 400;
+        if (used == 0) break;
+        conn->raw_pos += used;
+        if (piece_len == 0) continue;
+
+        if (on_body) {
+            on_body(conn_request(conn), piece, piece_len);
+        } else {
+            if (conn->body.received > (size_t)LW_MAX_BODY_SIZE) return 413;
+            if (in->data + conn->body_end != piece)
+                memmove(in->data + conn->body_end, piece, piece_len);
+            conn->body_end += piece_len;
+        }
+    }
+
+    // Streamed pieces are gone, keep only the head and whatever follows
+    size_t head_len = conn->parser.head_len;
+    if (on_body && conn->raw_pos > head_len) {
+        memmove(in->data + head_len, in->data + conn->raw_pos, in->len - conn->raw_pos);
+        in->len -= conn->raw_pos - head_len;
+        conn->raw_pos = conn->body_end = head_len;
+    }
+    return 0;
+}
+
+/* Returns 1 once a whole request (head and body) is in, 0 when more bytes
+ * are needed, or a negated HTTP status to reject it with. */
+static int conn_read_request(lw_conn_t *conn) {
+    lw_parser_t *parser = &conn->parser;
+
+    if (parser->state != LW_PARSE_DONE) {
+        int rc = lw_parser_execute(parser, conn->in.data, conn->in.len);
+        if (rc < 0) return -400;
+        if (rc == 0) return conn->in.len >= BUFFER_SIZE - 1 ? -431 : 0;
+
+        int status = conn_begin_body(conn);
+        if (status) return -status;
+    }
+
+    int status = conn_decode_body(conn);
+    if (status) return -status;
+    return conn->body.state == LW_CHUNK_DONE ? 1 : 0;
+}
+
+/* How many bytes `in` should hold before the next parse attempt. */
+static size_t conn_read_want(lw_conn_t *conn) {
+    if (conn->parser.state != LW_PARSE_DONE)
+        return BUFFER_SIZE - 1;
+
+    // A buffered Content-Length body is read in one go
+    int streaming = conn->route && conn->route->on_body;
+    if (!streaming && conn->body.framing == LW_BODY_LENGTH)
+        return conn->raw_pos + conn->body.remaining;
+
+    return conn->in.len + BUFFER_SIZE;
+}
+
+/* Appends src compressed by zc to out, framed as one chunk if chunked.
+ * Nothing is appended when the compressor holds everything back, an
+ * empty chunk would end the body. */
+static int queue_compressed(lw_buf_t *out, lw_compressor_t *zc, const void *src, size_t len,
+                            lw_flush_t flush, int chunked) {
+    size_t start = out->len;
+    uint64_t started = lw_now_ns();
+
+    // The size line is fixed width so it can be filled in afterwards
+    const size_t size_line = chunked ? 10 : 0;     // "%08zx\r\n"
+    if (lw_buf_reserve(out, size_line) < 0) return -1;
+    out->len += size_line;
+    if (lw_compressor_write(zc, src, len, flush, out) < 0) {
+        out->len = start;
+        return -1;
+    }
+
+    size_t zlen = out->len - start - size_line;
+    lw_metrics_compress(len, zlen, lw_now_ns() - started);
+    if (zlen == 0) {
+        out->len = start;
+    } else if (chunked) {
+        char line[24];
+        snprintf(line, sizeof(line), "%08zx\r\n", zlen);
+        memcpy(out->data + start, line, size_line);
+        if (lw_buf_append(out, "\r\n", 2) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Compresses the next piece of the file into `out` as one chunk. The last
+ * piece also finishes the stream and adds the terminating chunk. */
+static int conn_stage_compressed(lw_conn_t *conn) {
+    lw_buf_t *out = &conn->out;
+    char piece[LW_FILE_CHUNK];
+    ssize_t n = 0;
+
+    size_t want = conn->file_left < LW_FILE_CHUNK ? conn->file_left : LW_FILE_CHUNK;
+    if (want > 0) {
+        n = pread(conn->file_fd, piece, want, conn->file_off);
+        if (n <= 0) return -1;
+        conn->file_off += n;
+        conn->file_left -= n;
+    }
+    lw_flush_t flush = conn->file_left == 0 ? LW_FLUSH_END : LW_FLUSH_NONE;
+    if (queue_compressed(out, conn->file_zc, n > 0 ? piece : NULL, n, flush, 1) < 0) return -1;
+
+    if (flush == LW_FLUSH_END) {
+        if (lw_buf_append(out, "0\r\n\r\n", 5) < 0) return -1;
+        lw_compressor_free(conn->file_zc);
+        conn->file_zc = NULL;
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    return 0;
+}
+
+/* Collects what is left of `out` and the queued bodies, in wire order. */
+static int conn_gather(lw_conn_t *conn, struct iovec *iov, int max) {
+    int count = 0;
+    size_t off = conn->out_off;
+    size_t sent = conn->seg_sent;
+
+    for (int i = conn->seg_pos; count < max; i++) {
+        size_t next_at = i < conn->seg_count ? conn->segs[i].at : conn->out.len;
+        if (off < next_at) {
+            iov[count].iov_base = conn->out.data + off;
+            iov[count++].iov_len = next_at - off;
+            off = next_at;
+            if (count == max) break;
+        }
+        if (i >= conn->seg_count) break;
+
+        lw_seg_t *seg = &conn->segs[i];
+        iov[count].iov_base = (char *)seg->data + sent;
+        iov[count++].iov_len = seg->len - sent;
+        sent = 0;
+    }
+    return count;
+}
+
+/* Marks n more bytes as sent; bodies are released as soon as they are out. */
+static void conn_advance(lw_conn_t *conn, size_t n) {
+    while (n > 0) {
+        size_t next_at = conn->seg_pos < conn->seg_count
+                             ? conn->segs[conn->seg_pos].at : conn->out.len;
+        if (conn->out_off < next_at) {
+            size_t k = next_at - conn->out_off;
+            if (k > n) k = n;
+            conn->out_off += k;
+            n -= k;
+            continue;
+        }
+        if (conn->seg_pos >= conn->seg_count) break;
+
+        lw_seg_t *seg = &conn->segs[conn->seg_pos];
+        size_t k = seg->len - conn->seg_sent;
+        if (k > n) k = n;
+        conn->seg_sent += k;
+        n -= k;
+        if (conn->seg_sent == seg->len) {
+            lw_seg_release(seg);
+            conn->seg_pos++;
+            conn->seg_sent = 0;
+        }
+    }
+}
+
+/* Writes conn->out with the queued bodies in between, then the queued
+ * file body if any. Plain sockets get everything in one writev; TLS
+ * writes one piece per SSL_write, small bodies already sit in `out`.
+ * Returns 1 once everything is sent, 0 when it would block, -1 on error. */
+static int conn_flush(lw_conn_t *conn) {
+    lw_buf_t *out = &conn->out;
+
+    for (;;) {
+        while (conn->out_off < out->len || conn->seg_pos < conn->seg_count) {
+            struct iovec iov[LW_IOV_MAX];
+            ssize_t n;
+
+            if (conn->ssl) {
+                conn_gather(conn, iov, 1);
+                n = SSL_write(conn->ssl, iov[0].iov_base, iov[0].iov_len);
+                if (n <= 0) {
+                    int err = SSL_get_error(conn->ssl, n);
+                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+                    return -1;
+                }
+            } else {
+                n = writev(conn->src.fd, iov, conn_gather(conn, iov, LW_IOV_MAX));
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                    return -1;
+                }
+            }
+            conn_advance(conn, n);
+            lw_metric_add(&conn->loop->metrics->bytes_out, n);
+            conn->progress = 1;
+        }
+
+        out->len = 0;
+        conn->out_off = 0;
+        conn_release_segs(conn);
+
+        if (conn->file_fd < 0) return 1;
+        if (conn->file_zc) {
+            if (conn_stage_compressed(conn) < 0) return -1;
+            continue;
+        }
+        if (conn->file_left == 0) {
+            close(conn->file_fd);
+            conn->file_fd = -1;
+            return 1;
+        }
+
+        if (!conn->ssl) {
+            // Straight from the page cache to the socket
+            ssize_t n = sendfile(conn->src.fd, conn->file_fd, &conn->file_off, conn->file_left);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            if (n == 0) return -1;  // file shrank underneath us
+            conn->file_left -= n;
+            lw_metric_add(&conn->loop->metrics->bytes_out, n);
+            conn->progress = 1;
+            continue;
+        }
+
+        if (conn->ktls) {
+            // The kernel encrypts, so the file still never enters userspace
+            ossl_ssize_t n = SSL_sendfile(conn->ssl, conn->file_fd, conn->file_off, conn->file_left, 0);
+            if (n <= 0) {
+                int err = SSL_get_error(conn->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) return 0;
+                return -1;
+            }
+            conn->file_off += n;
+            conn->file_left -= n;
+            lw_metric_add(&conn->loop->metrics->bytes_out, n);
+            conn->progress = 1;
+            continue;
+        }
+
+        // TLS: stage the next piece of the file in `out`
+        size_t want = conn->file_left < LW_FILE_CHUNK ? conn->file_left : LW_FILE_CHUNK;
+        if (lw_buf_reserve(out, want) < 0) return -1;
+        ssize_t n = pread(conn->file_fd, out->data, want, conn->file_off);
+        if (n <= 0) return -1;
+        out->len = n;
+        conn->file_off += n;
+        conn->file_left -= n;
+    }
+}
+
+/* Queues an error response and closes the connection after it. */
+static void conn_reject(lw_conn_t *conn, int status) {
+    const char *body = status == 413 ? "413 Payload Too Large" :
+                       status == 431 ? "431 Request Header Fields Too Large" :
+                       "400 Bad Request";
+
+    http_response_t response = {0};
+    init_response(&response);
+    response.arena = &conn->arena;
+    response.status_code = status;
+    lw_set_header(&response, "Content-Type: text/plain");
+    lw_set_header(&response, "Connection: close");
+    lw_set_body(&response, body);
+    size_t queued = conn->out.len;
+    lw_serialize_response(&response, NULL, &conn->out);
+    free_response(&response);
+
+    lw_metrics_t *m = conn->loop->metrics;
+    lw_metric_add(&m->status[status], 1);
+    if (status != 413) lw_metric_add(&m->parse_errors, 1);
+
+    conn->status = status;
+    conn->resp_bytes = conn->out.len - queued;
+    conn_log(conn);
+
+    conn->close_after = 1;
+    conn->state = LW_CONN_WRITING;
+}
+
+/* Decides whether the connection survives this request. */
+static int request_keep_alive(lw_conn_t *conn, http_request_t *request) {
+    if (LW_KEEPALIVE_TIMEOUT <= 0 || conn->requests >= LW_KEEPALIVE_MAX || conn->loop->draining)
+        return 0;
+
+    int keep = request->version_minor >= 1;
+    const char *connection = lw_get_header(request, "Connection");
+    if (connection) {
+        if (strcasestr(connection, "close")) keep = 0;
+        else if (strcasestr(connection, "keep-alive")) keep = 1;
+    }
+    return keep;
+}
+
+static void conn_finish(lw_conn_t *conn, http_response_t *response);
+static void conn_drive(lw_loop_t *loop, lw_conn_t *conn);
+
+/* Runs the handler for the request at the front of conn->in and appends
+ * its response to conn->out. A handler that suspended on lw_wait_fd or
+ * lw_wait_timer is finished by conn_resume instead. */
+static void conn_dispatch(lw_conn_t *conn) {
+    lw_buf_t *in = &conn->in;
+    route_t *route = conn->route;
+
+    // Fields are views into conn->in, nothing is copied
+    http_request_t *req = conn_request(conn);
+    if (route && route->on_body) {
+        req->body = NULL;   // already handed to on_body
+        req->body_length = conn->body.received;
+    } else if (conn->body.received > 0) {
+        req->body = in->data + conn->parser.head_len;
+        req->body_length = conn->body.received;
+    }
+
+    // Terminate the body for handlers that treat it as a string
+    conn->body_saved = in->data[conn->body_end];
+    in->data[conn->body_end] = '\0';
+
+    conn->requests++;
+    conn->keep_alive = request_keep_alive(conn, req);
+
+    (LW_VERBOSE) ? printf("[INFO] Found %d headers\n", req->header_count) : -1;
+    for (int i = 0; i < req->header_count; ++i)
+        (LW_VERBOSE) ? printf("[INFO] Header[%d]: \"%s\"\n", i, req->headers[i]) : -1;
+
+    http_response_t response = {0};
+    init_response(&response);
+    response.arena = &conn->arena;
+
+    if (route) {
+        route->handler(req, &response);
+    } else {
+        // 404 Not Found
+        response.status_code = 404;
+        lw_set_header(&response, "Content-Type: text/plain");
+        lw_set_body(&response, "404 Not Found");
+    }
+
+    if (conn->wait.resume) {
+        // The request stays at the front of `in` until it is finished
+        conn->pending = response;
+        conn->state = LW_CONN_SUSPENDED;
+        return;
+    }
+
+    conn_finish(conn, &response);
+}
+
+// Drops the finished request from `in`, a pipelined one may follow
+static void conn_end_request(lw_conn_t *conn) {
+    lw_buf_t *in = &conn->in;
+    size_t request_len = conn->raw_pos;
+
+    lw_metrics_request(conn->loop->metrics, conn->route, conn->status, lw_now_ns() - conn->started_ns);
+    conn_log(conn);
+
+    // Kept alive before the drain began, but nothing more is served now
+    if (conn->loop->draining) conn->close_after = 1;
+
+    free_request(&conn->request);
+    in->data[conn->body_end] = conn->body_saved;
+    memmove(in->data, in->data + request_len, in->len - request_len);
+    in->len -= request_len;
+
+    lw_parser_reset(&conn->parser);
+    memset(&conn->request, 0, sizeof(conn->request));
+    lw_compressor_free(conn->stream.zc);
+    memset(&conn->stream, 0, sizeof(conn->stream));
+    conn->route = NULL;
+    conn->timeout = LW_TIMEOUT_NONE;   // the next request gets its own deadlines
+}
+
+/* Serializes the handler's response and picks the next state. A stream
+ * keeps its request until lw_stream_end; anything else is done with it. */
+static void conn_finish(lw_conn_t *conn, http_response_t *response) {
+    http_request_t *req = &conn->request;
+    int keep_alive = conn->keep_alive;
+    lw_seg_t body;
+
+    // Points into this request's headers, only valid until free_request
+    const char *accept_encoding = lw_get_header(req, "Accept-Encoding");
+
+    // Add reload header if needed
+    time_t now = time(NULL);
+    if (now - hot_reload_state.last_change_time <= 2) {
+        lw_set_header(response, "X-Reload: 1");
+    }
+
+    if (!lw_get_response_header(response, "Connection"))
+        lw_set_header(response, keep_alive ? "Connection: keep-alive" : "Connection: close");
+    conn->close_after = !keep_alive;
+    conn->status = response->status_code;
+    response->head_only = req->method == HEAD;
+
+    // Files too big to cache have no stored variant, compress them on the way out
+    if (LW_COMPRESS && response->body_fd >= 0 && response->encoding == LW_ENC_IDENTITY &&
+        req->version_minor >= 1 &&
+        lw_compressible(lw_get_response_header(response, "Content-Type"))) {
+        lw_encoding_t encoding = lw_pick_encoding(accept_encoding);
+        response->vary = 1;
+        // HEAD gets the same headers, with no compressor to feed
+        if (!response->head_only) conn->file_zc = lw_compressor_new(encoding);
+        if (conn->file_zc || (response->head_only && encoding != LW_ENC_IDENTITY)) {
+            response->encoding = encoding;
+            response->transfer_chunked = 1;
+        }
+    }
+
+    // Picked here rather than in lw_stream_begin, Content-Type may come after it
+    if (LW_COMPRESS && conn->stream.produce && response->encoding == LW_ENC_IDENTITY &&
+        lw_compressible(lw_get_response_header(response, "Content-Type"))) {
+        lw_encoding_t encoding = lw_pick_encoding(accept_encoding);
+        response->vary = 1;
+        if (!response->head_only) conn->stream.zc = lw_compressor_new(encoding);
+        if (conn->stream.zc || (response->head_only && encoding != LW_ENC_IDENTITY))
+            response->encoding = encoding;
+    }
+
+    size_t queued = conn->out.len + conn->seg_bytes;
+    if (lw_serialize_head(response, accept_encoding, &conn->out, &body) < 0 ||
+               conn_queue_body(conn, &body) < 0) {
+        fprintf(stderr, "[ERR] Failed to serialize response\n");
+        conn->close_after = 1;
+    } else if (response->body_fd >= 0) {
+        // The connection owns the file now, it goes out right after the headers
+        conn->file_fd = response->body_fd;
+        conn->file_off = response->body_offset;
+        conn->file_left = response->body_length;
+        response->body_fd = -1;
+    }
+    // Head and body as queued; a compressed file is logged at its source size
+    conn->resp_bytes = conn->out.len + conn->seg_bytes - queued + conn->file_left;
+
+    if (conn->stream.produce && response->head_only) {
+        // No body goes out for HEAD; the producer only gets to release its arg
+        conn->stream.closed = 1;
+        conn->stream.produce(req, response, LW_WAIT_ERROR, conn->stream.arg);
+        conn_wait_cancel(conn);
+        conn->stream.produce = NULL;
+    }
+
+    free_response(response);
+
+    if (conn->stream.produce) {
+        // The producer gets an empty response to hand back, its head is gone
+        memset(&conn->pending, 0, sizeof(conn->pending));
+        init_response(&conn->pending);
+        conn->pending.arena = &conn->arena;
+        conn->state = LW_CONN_STREAMING;
+        return;
+    }
+
+    conn_end_request(conn);
+
+    // A file body must be on the wire before the next response is queued
+    conn->state = (conn->close_after || conn->file_fd >= 0)
+                      ? LW_CONN_WRITING : LW_CONN_READING;
+}
+
+/* Starts a response whose body is produced after the handler returns.
+ * Once the head is queued, produce runs whenever the queue has drained
+ * and calls lw_stream_write until it returns 1, then returns itself;
+ * lw_stream_end finishes the body. A producer with nothing to write yet
+ * waits with lw_wait_fd/lw_wait_timer, or returns and is parked until
+ * lw_stream_wake. It gets LW_WAIT_ERROR once if the client goes away.
+ * HTTP/1.1 peers get chunked framing, HTTP/1.0 ones a body that ends
+ * with the connection. With -c a compressible Content-Type is encoded
+ * as it is written and flushed to the client whenever the producer
+ * returns or the stream is woken. */
+int lw_stream_begin(http_request_t *request, http_response_t *response, lw_resume_t produce, void *arg) {
+    lw_conn_t *conn = request->conn;
+    if (!conn || !produce || conn->stream.produce) return -1;
+
+    conn->stream.produce = produce;
+    conn->stream.arg = arg;
+    conn->stream.chunked = request->version_minor >= 1;
+    if (!conn->stream.chunked) conn->keep_alive = 0;
+
+    response->stream = 1;
+    response->transfer_chunked = conn->stream.chunked;
+    return 0;
+}
+
+/* Ends a stream that could not be queued: the partial chunk from start
+ * on is dropped and the connection closes once the producer returns. */
+static int stream_fail(lw_conn_t *conn, size_t start) {
+    conn->out.len = start;
+    conn->stream.closed = 1;
+    conn->state = LW_CONN_CLOSING;
+    return -1;
+}
+
+/* Queues len bytes of the body. Returns 0 if the producer may go on,
+ * 1 once it should return and wait to be called again, -1 if the stream
+ * is over or the client is gone. */
+int lw_stream_write(http_request_t *request, const void *data, size_t len) {
+    lw_conn_t *conn = request->conn;
+    if (!conn || conn->state != LW_CONN_STREAMING || conn->stream.ended || conn->stream.closed)
+        return -1;
+
+    // An empty chunk would end the body
+    size_t start = conn->out.len;
+    if (len > 0 && conn->stream.zc) {
+        // Flushed once the producer returns, small writes share a block
+        if (queue_compressed(&conn->out, conn->stream.zc, data, len, LW_FLUSH_NONE,
+                             conn->stream.chunked) < 0)
+            return stream_fail(conn, start);
+        conn->stream.held = 1;
+        conn->resp_bytes += len;
+    } else if (len > 0) {
+        if ((conn->stream.chunked && lw_buf_printf(&conn->out, "%zx\r\n", len) < 0) ||
+            lw_buf_append(&conn->out, data, len) < 0 ||
+            (conn->stream.chunked && lw_buf_append(&conn->out, "\r\n", 2) < 0))
+            return stream_fail(conn, start);
+        conn->resp_bytes += len;
+    }
+    return conn->out.len + conn->seg_bytes >= LW_STREAM_QUEUE_MAX;
+}
+
+int lw_stream_end(http_request_t *request) {
+    lw_conn_t *conn = request->conn;
+    if (!conn || conn->state != LW_CONN_STREAMING || conn->stream.ended) return -1;
+
+    conn->stream.ended = 1;
+    if (conn->stream.zc) {
+        int rc = queue_compressed(&conn->out, conn->stream.zc, NULL, 0, LW_FLUSH_END,
+                                  conn->stream.chunked);
+        lw_compressor_free(conn->stream.zc);
+        conn->stream.zc = NULL;
+        if (rc < 0) return -1;
+    }
+    if (conn->stream.chunked && lw_buf_append(&conn->out, "0\r\n\r\n", 5) < 0)
+        return -1;
+    return 0;
+}
+
+/* Pushes the writes a stream's compressor holds back into `out`, so the
+ * client can decode everything written so far. */
+static int conn_stream_sync(lw_conn_t *conn) {
+    if (!conn->stream.zc || !conn->stream.held) return 0;
+    conn->stream.held = 0;
+    return queue_compressed(&conn->out, conn->stream.zc, NULL, 0, LW_FLUSH_SYNC,
+                            conn->stream.chunked);
+}
+
+/* Flushes a stream and asks its producer for more once the queue has
+ * drained. Returns 0 while it waits on the socket or the producer. */
+static int conn_stream(lw_conn_t *conn) {
+    int rc = conn_stream_sync(conn) < 0 ? -1 : conn_flush(conn);
+    if (rc == 0) return 0;
+    if (rc < 0) {
+        conn->state = LW_CONN_CLOSING;
+        return 1;
+    }
+
+    if (conn->stream.ended) {
+        conn_end_request(conn);
+        conn->state = conn->close_after ? LW_CONN_CLOSING : LW_CONN_READING;
+        return 1;
+    }
+    if (conn->wait.resume) return 0;
+
+    conn->stream.produce(&conn->request, &conn->pending, LW_WAIT_WRITE, conn->stream.arg);
+    if (conn_stream_sync(conn) < 0) {
+        conn->state = LW_CONN_CLOSING;
+        return 1;
+    }
+
+    // Parked until lw_stream_wake, unless a write failed the stream
+    return conn->out.len > 0 || conn->stream.ended || conn->state != LW_CONN_STREAMING;
+}
+
+/* Sends what was written to a parked stream from outside its producer,
+ * e.g. by a broadcast, or closes it if that write failed. Only from the
+ * loop that owns the connection. */
+void lw_stream_wake(http_request_t *request) {
+    lw_conn_t *conn = request->conn;
+    if (conn && !conn->dead &&
+        (conn->state == LW_CONN_STREAMING || conn->state == LW_CONN_CLOSING))
+        conn_drive(conn->loop, conn);
+}
+
+/* Advances the connection state machine as far as the socket allows. */
+static void conn_step(lw_loop_t *loop, lw_conn_t *conn) {
+    if (conn->dead) return;
+
+    // A pool thread has the SSL, pick this up once it hands it back
+    if (conn->hs_offloaded) {
+        conn->hs_pending = 1;
+        return;
+    }
+
+    for (;;) {
+        switch (conn->state) {
+        case LW_CONN_HANDSHAKE: {
+            if (lw_handshake_pool_enabled()) {
+                lw_handshake_submit(conn);
+                return;
+            }
+            int rc = lw_tls_accept(conn->ssl);
+            if (rc == 0) return;
+            if (rc < 0) { conn_close(loop, conn); return; }
+            conn_handshake_done(conn);
+            break;
+        }
+        case LW_CONN_READING: {
+            // Pipelined responses are batched into one write, up to a cap
+            if (conn->out.len + conn->seg_bytes >= LW_PIPELINE_OUT_MAX) {
+                conn->state = LW_CONN_WRITING;
+                break;
+            }
+
+            int rc = conn_read_request(conn);
+            if (rc == 1) {
+                conn->state = LW_CONN_DISPATCH;
+                break;
+            }
+            if (rc < 0) {
+                conn_reject(conn, -rc);
+                break;
+            }
+
+            // Out of buffered input: send what is queued before waiting
+            if (conn->out.len > 0 || conn->seg_count > 0) {
+                conn->state = LW_CONN_WRITING;
+                break;
+            }
+            if (conn->eof) {
+                // Peer is gone and what is left can never become a request
+                conn->state = LW_CONN_CLOSING;
+                break;
+            }
+
+            rc = conn_fill(conn, conn_read_want(conn));
+            if (rc == 0) return;
+            if (rc < 0) { conn_close(loop, conn); return; }
+            break;
+        }
+        case LW_CONN_DISPATCH:
+            conn_dispatch(conn);
+            break;
+        case LW_CONN_SUSPENDED:
+            // Input stays buffered until the handler is done
+            return;
+        case LW_CONN_STREAMING:
+            if (!conn_stream(conn)) return;
+            break;
+        case LW_CONN_WRITING: {
+            int rc = conn_flush(conn);
+            if (rc == 0) return;
+            if (rc < 0 || conn->close_after) {
+                conn->state = LW_CONN_CLOSING;
+                break;
+            }
+            conn->state = LW_CONN_READING;
+            break;
+        }
+        case LW_CONN_CLOSING:
+            conn_close(loop, conn);
+            return;
+        }
+    }
+}
+
+/* Arms the timeout for whatever conn waits on now. Fixed ones keep
+ * running for as long as the phase lasts, the others start over
+ * whenever bytes moved. Handlers and parked streams have none. */
+static void conn_update_timer(lw_loop_t *loop, lw_conn_t *conn) {
+    lw_timeout_t kind = LW_TIMEOUT_NONE;
+    int seconds = 0;
+
+    switch (conn->state) {
+    case LW_CONN_HANDSHAKE:
+        kind = LW_TIMEOUT_HANDSHAKE;
+        seconds = LW_TLS_HANDSHAKE_TIMEOUT;
+        break;
+    case LW_CONN_READING:
+        if (conn->parser.state == LW_PARSE_DONE) {
+            kind = LW_TIMEOUT_BODY;
+            seconds = LW_BODY_TIMEOUT;
+        } else if (conn->in.len == 0 && conn->requests > 0) {
+            kind = LW_TIMEOUT_IDLE;
+            seconds = LW_KEEPALIVE_TIMEOUT > 0 ? LW_KEEPALIVE_TIMEOUT : 5;
+        } else {
+            kind = LW_TIMEOUT_HEADER;
+            seconds = LW_HEADER_TIMEOUT;
+        }
+        break;
+    case LW_CONN_WRITING:
+        kind = LW_TIMEOUT_WRITE;
+        seconds = LW_WRITE_TIMEOUT;
+        break;
+    case LW_CONN_STREAMING:
+        // Only while the client holds it up, not while the producer has nothing
+        if (conn->out_off < conn->out.len || conn->seg_pos < conn->seg_count) {
+            kind = LW_TIMEOUT_WRITE;
+            seconds = LW_WRITE_TIMEOUT;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (kind == LW_TIMEOUT_NONE || seconds <= 0) {
+        lw_timer_cancel(&loop->timers, &conn->timer);
+    } else if (kind != conn->timeout ||
+               (conn->progress && (kind == LW_TIMEOUT_BODY || kind == LW_TIMEOUT_WRITE))) {
+        // One tick more, a deadline never comes early
+        lw_timer_arm(&loop->timers, &conn->timer, loop->tick + seconds + 1);
+    }
+    conn->timeout = kind;
+    conn->progress = 0;
+}
+
+static void conn_drive(lw_loop_t *loop, lw_conn_t *conn) {
+    conn_step(loop, conn);
+    if (!conn->dead) conn_update_timer(loop, conn);
+}
+
+/* Suspends the handler of request until fd is ready for events
+ * (LW_WAIT_READ/LW_WAIT_WRITE); resume then continues it on the same loop.
+ * The handler must return right after this. fd stays the caller's. */
+int lw_wait_fd(http_request_t *request, int fd, int events, lw_resume_t resume, void *arg) {
+    lw_conn_t *conn = request->conn;
+    if (!conn || conn->wait.resume || !resume) return -1;
+
+    conn->wait.src.kind = LW_EV_WAIT;
+    conn->wait.src.fd = fd;
+    conn->wait.timer = 0;
+
+    struct epoll_event ev = {0};
+    if (events & LW_WAIT_READ) ev.events |= EPOLLIN;
+    if (events & LW_WAIT_WRITE) ev.events |= EPOLLOUT;
+    ev.data.ptr = &conn->wait.src;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("[ERR] epoll_ctl add wait fd failed");
+        return -1;
+    }
+
+    conn->wait.resume = resume;
+    conn->wait.arg = arg;
+    return 0;
+}
+
+// Suspends the handler of request for ms milliseconds, like lw_wait_fd
+int lw_wait_timer(http_request_t *request, long ms, lw_resume_t resume, void *arg) {
+    if (!request->conn || request->conn->wait.resume) return -1;
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("[ERR] timerfd_create failed");
+        return -1;
+    }
+
+    // An all-zero it_value would disarm the timer instead of firing now
+    if (ms <= 0) ms = 1;
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0 ||
+        lw_wait_fd(request, fd, LW_WAIT_READ, resume, arg) < 0) {
+        close(fd);
+        return -1;
+    }
+    request->conn->wait.timer = 1;
+    return 0;
+}
+
+// Continues a suspended handler once what it waits on is ready
+static void conn_resume(lw_loop_t *loop, lw_conn_t *conn, uint32_t ready) {
+    if (conn->dead || !conn->wait.resume) return;
+
+    int events = 0;
+    if (conn->wait.timer) {
+        events = LW_WAIT_TIMER;
+    } else {
+        if (ready & EPOLLIN) events |= LW_WAIT_READ;
+        if (ready & EPOLLOUT) events |= LW_WAIT_WRITE;
+        if (ready & (EPOLLERR | EPOLLHUP)) events |= LW_WAIT_ERROR;
+    }
+
+    lw_resume_t resume = conn->wait.resume;
+    void *arg = conn->wait.arg;
+    conn_wait_cancel(conn);
+    resume(&conn->request, &conn->pending, events, arg);
+    if (conn->wait.resume) return;  // waits again
+
+    // A stream's producer just goes on; a handler's response is complete
+    if (conn->state == LW_CONN_SUSPENDED) conn_finish(conn, &conn->pending);
+    conn_drive(loop, conn);
+}
+
+const char *const lw_timeout_names[LW_TIMEOUT_KINDS] = {
+    "none", "handshake", "header", "idle", "body", "write"
+};
+
+/* Closes connections whose timer ran out. The wheel only hands out what
+ * is due, so this costs nothing per idle connection. */
+static void loop_expire(lw_loop_t *loop) {
+    lw_timer_t *timer;
+    while ((timer = lw_wheel_next(&loop->timers, loop->tick))) {
+        lw_conn_t *conn = (lw_conn_t *)((char *)timer - offsetof(lw_conn_t, timer));
+
+        // A pool thread has the SSL; look again next tick
+        if (conn->hs_offloaded) {
+            lw_timer_arm(&loop->timers, timer, loop->tick + 1);
+            continue;
+        }
+
+        lw_metric_add(&loop->metrics->timeouts[conn->timeout], 1);
+        (LW_VERBOSE) ? printf("[LW] Closing connection, %s timeout\n", lw_timeout_names[conn->timeout]) : 0;
+        conn_close(loop, conn);
+    }
+}
+
+// Between requests with nothing left to send: safe to close while draining
+static int conn_idle(lw_conn_t *conn) {
+    return conn->state == LW_CONN_READING && conn->in.len == 0 && conn->out.len == 0 &&
+           conn->seg_count == 0 && conn->file_fd < 0;
+}
+
+/* Stops accepting, ends event streams and closes idle keep-alive
+ * connections; the rest close after their current response. The
+ * listener stays open, a successor may be accepting from it. */
+static void loop_begin_drain(lw_loop_t *loop) {
+    loop->draining = 1;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listener.fd, NULL);
+    lw_sse_drain(loop);
+
+    lw_conn_t *conn = loop->conns;
+    while (conn) {
+        lw_conn_t *next = conn->next;
+        if (conn_idle(conn)) conn_close(loop, conn);
+        conn = next;
+    }
+}
+
+// Closes whatever outlived the deadline; lw_loop_close takes the handshakes on the pool
+static void loop_close_all(lw_loop_t *loop) {
+    lw_conn_t *conn = loop->conns;
+    while (conn) {
+        lw_conn_t *next = conn->next;
+        if (!conn->hs_offloaded) conn_close(loop, conn);
+        conn = next;
+    }
+}
+
+static void loop_accept(lw_loop_t *loop) {
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(loop->listener.fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("[ERR] Accept failed");
+            return;
+        }
+
+        // Over the cap: closed before a byte is read or a handshake started
+        if (LW_MAX_PER_IP > 0 && lw_ip_acquire(addr.sin_addr) < 0) {
+            lw_metric_add(&loop->metrics->per_ip_rejected, 1);
+            close(fd);
+            continue;
+        }
+
+        lw_conn_t *conn = conn_new(loop, fd, &addr);
+        if (!conn) {
+            if (LW_MAX_PER_IP > 0) lw_ip_release(addr.sin_addr);
+            close(fd);
+            continue;
+        }
+
+        // Edge-triggered: the client may already have sent data
+        conn_drive(loop, conn);
+    }
+}
+
+// Resumes connections whose handshake step ran on the pool
+static void loop_collect_handshakes(lw_loop_t *loop) {
+    lw_conn_t *conn = lw_handshake_collect(loop);
+    while (conn) {
+        lw_conn_t *next = conn->hs_next;
+        conn->hs_offloaded = 0;
+
+        if (conn->hs_rc < 0) {
+            conn_close(loop, conn);
+        } else if (conn->hs_rc == 1) {
+            conn_handshake_done(conn);
+            conn_drive(loop, conn);
+        } else if (conn->hs_pending) {
+            // More bytes came in meanwhile, edge-triggered epoll won't say so again
+            conn_drive(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+int lw_loop_init(lw_loop_t *loop, int id, int listen_fd) {
+    memset(loop, 0, sizeof(*loop));
+    loop->id = id;
+    loop->listener.kind = LW_EV_LISTENER;
+    loop->listener.fd = listen_fd;
+    loop->now = time(NULL);
+    loop->tick = lw_now_ns() / 1000000000u;
+    lw_wheel_init(&loop->timers, loop->tick);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("[ERR] epoll_create1 failed");
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loop->listener;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("[ERR] epoll_ctl add listener failed");
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    if (lw_metrics_loop_init(loop) < 0 || lw_log_loop_init(loop) < 0) {
+        lw_metrics_loop_close(loop);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    // Where lw_loop_drain reaches the loop from the signal thread
+    loop->wake.kind = LW_EV_WAKE;
+    loop->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.ptr = &loop->wake;
+    if (loop->wake.fd < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake.fd, &ev) < 0) {
+        perror("[ERR] Wake eventfd failed");
+        if (loop->wake.fd >= 0) close(loop->wake.fd);
+        lw_metrics_loop_close(loop);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    // Where lw_broadcast hands over events for this loop's subscribers
+    if (lw_sse_loop_init(loop) < 0) {
+        lw_metrics_loop_close(loop);
+        close(loop->wake.fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+    ev.data.ptr = &loop->sse_wake;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->sse_wake.fd, &ev) < 0)
+        perror("[ERR] epoll_ctl add broadcast eventfd failed");
+
+    // Where the handshake pool hands connections back
+    loop->hs_wake.fd = -1;
+    if (LW_SSL_ENABLED == 1) {
+        if (lw_handshake_loop_init(loop) < 0) {
+            lw_sse_loop_close(loop);
+            lw_metrics_loop_close(loop);
+            close(loop->wake.fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+        ev.data.ptr = &loop->hs_wake;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->hs_wake.fd, &ev) < 0)
+            perror("[ERR] epoll_ctl add handshake eventfd failed");
+    }
+
+    return 0;
+}
+
+int lw_loop_run(lw_loop_t *loop) {
+    struct epoll_event events[LW_MAX_EVENTS];
+    lw_metrics_bind(loop->metrics);
+
+    while (1) {
+        int ready = epoll_wait(loop->epoll_fd, events, LW_MAX_EVENTS, 1000);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("[ERR] epoll_wait failed");
+            return -1;
+        }
+        loop->now = time(NULL);
+        loop->tick = lw_now_ns() / 1000000000u;
+
+        for (int i = 0; i < ready; i++) {
+            lw_ev_source_t *src = events[i].data.ptr;
+
+            switch (src->kind) {
+            case LW_EV_LISTENER:
+                if (!loop->draining) loop_accept(loop);
+                break;
+            case LW_EV_WAKE: {
+                uint64_t count;
+                while (read(loop->wake.fd, &count, sizeof(count)) > 0);
+                break;
+            }
+            case LW_EV_BROADCAST:
+                lw_sse_deliver(loop);
+                break;
+            case LW_EV_HANDSHAKE:
+                loop_collect_handshakes(loop);
+                break;
+            case LW_EV_CONN:
+                conn_drive(loop, (lw_conn_t *)src);
+                break;
+            case LW_EV_WAIT: {
+                lw_conn_t *conn = (lw_conn_t *)((char *)src - offsetof(lw_conn_t, wait));
+                conn_resume(loop, conn, events[i].events);
+                break;
+            }
+            }
+        }
+
+        loop_expire(loop);
+        lw_sse_tick(loop);
+
+        time_t drain_at = __atomic_load_n(&loop->drain_at, __ATOMIC_ACQUIRE);
+        if (drain_at && !loop->draining) loop_begin_drain(loop);
+        int done = loop->draining && (loop->conn_count == 0 || loop->now >= drain_at);
+        if (done) loop_close_all(loop);
+
+        while (loop->graveyard) {
+            lw_conn_t *next = loop->graveyard->next;
+            free(loop->graveyard);
+            loop->graveyard = next;
+        }
+        if (done) return 0;
+    }
+}
+
+/* Asks loop to finish its connections and return by deadline. Safe from
+ * any thread; calling it again moves the deadline. */
+void lw_loop_drain(lw_loop_t *loop, time_t deadline) {
+    __atomic_store_n(&loop->drain_at, deadline, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    while (write(loop->wake.fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/* Closes what the loop still holds. Run after lw_handshake_pool_stop, so
+ * handshakes that were on the pool are back here too. */
+void lw_loop_close(lw_loop_t *loop) {
+    if (loop->hs_wake.fd >= 0) {
+        for (lw_conn_t *conn = lw_handshake_collect(loop); conn; conn = conn->hs_next)
+            conn->hs_offloaded = 0;
+    }
+    while (loop->conns) conn_close(loop, loop->conns);
+    while (loop->graveyard) {
+        lw_conn_t *next = loop->graveyard->next;
+        free(loop->graveyard);
+        loop->graveyard = next;
+    }
+
+    lw_sse_loop_close(loop);
+    lw_metrics_loop_close(loop);
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+    if (loop->hs_wake.fd >= 0) close(loop->hs_wake.fd);
+    loop->hs_wake.fd = -1;
+    if (loop->wake.fd >= 0) close(loop->wake.fd);
+    loop->wake.fd = -1;
+}
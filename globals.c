@@ -9,9 +9,28 @@ int LW_KEY = 0;
 int LW_SSL_ENABLED = 0;
 int reload_needed = 0;
 int LW_COMPRESS = 0;
+int LW_WORKERS = 0;   // 0 = one per online CPU
+int LW_KEEPALIVE_TIMEOUT = 5;   // seconds, 0 disables keep-alive
+int LW_KEEPALIVE_MAX = 100;     // requests per connection
+long LW_MAX_BODY_SIZE = 8 * 1024 * 1024;   // buffered request bodies
+long LW_CACHE_SIZE = 64 * 1024 * 1024;     // static asset cache, 0 disables it
+long LW_TLS_SESSION_CACHE = 4096;   // TLS sessions cached per worker, 0 disables
+int LW_TLS_TICKET_ROTATE = 3600;    // seconds per ticket key, 0 disables tickets
+int LW_KTLS = 0;                    // hand record encryption to the kernel
+int LW_TLS_HANDSHAKE_TIMEOUT = 10;  // seconds to finish a TLS handshake
+int LW_HANDSHAKE_WORKERS = 0;       // threads running SSL_accept, 0 = on the loops
+int LW_HEADER_TIMEOUT = 10;         // seconds to receive a whole request head
+int LW_BODY_TIMEOUT = 30;           // seconds between two reads of a request body
+int LW_WRITE_TIMEOUT = 30;          // seconds between two writes the client accepts
+int LW_MAX_PER_IP = 0;              // open connections per client address, 0 = no cap
 const char* LW_CERT_FILE = NULL;
 const char* LW_KEY_FILE = NULL;
-extern const char *ACCEPT_ENCODING = NULL;
+const char* LW_EC_CERT_FILE = NULL;     // optional second, ECDSA certificate
+const char* LW_EC_KEY_FILE = NULL;
+const char* LW_METRICS_PATH = NULL;     // serve Prometheus metrics here when set
+const char* LW_ACCESS_LOG = "-";        // access log file, "-" for stdout, "off"
+int LW_LOG_FORMAT = LW_LOG_COMMON;      // or LW_LOG_JSON
+int LW_DRAIN_TIMEOUT = 30;              // seconds open requests get on shutdown or upgrade
 
 SSL *LW_SSL = NULL;
 SSL_CTX *ssl_ctx = NULL;
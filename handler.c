@@ -1,117 +1,292 @@
+#define _GNU_SOURCE
 #include "run.h"
 #include <strings.h>   /* strcasecmp */
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
-void lw_route(http_method_t method, const char *path, route_handler_t handler) {
-    if (lw_ctx.route_count >= MAX_ROUTES) {
-        fprintf(stderr, "[ERR] Maximum number of routes exceeded\n");
-        return;
+#define STATUS(code, text) \
+    [code - 100] = { "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n") - 1 }
+
+/* Every registered status code, with its status line ready to copy. */
+static const struct {
+    const char *line;
+    size_t len;
+} status_lines[500] = {
+    STATUS(100, "Continue"),
+    STATUS(101, "Switching Protocols"),
+    STATUS(103, "Early Hints"),
+    STATUS(200, "OK"),
+    STATUS(201, "Created"),
+    STATUS(202, "Accepted"),
+    STATUS(203, "Non-Authoritative Information"),
+    STATUS(204, "No Content"),
+    STATUS(205, "Reset Content"),
+    STATUS(206, "Partial Content"),
+    STATUS(207, "Multi-Status"),
+    STATUS(208, "Already Reported"),
+    STATUS(226, "IM Used"),
+    STATUS(300, "Multiple Choices"),
+    STATUS(301, "Moved Permanently"),
+    STATUS(302, "Found"),
+    STATUS(303, "See Other"),
+    STATUS(304, "Not Modified"),
+    STATUS(305, "Use Proxy"),
+    STATUS(307, "Temporary Redirect"),
+    STATUS(308, "Permanent Redirect"),
+    STATUS(400, "Bad Request"),
+    STATUS(401, "Unauthorized"),
+    STATUS(402, "Payment Required"),
+    STATUS(403, "Forbidden"),
+    STATUS(404, "Not Found"),
+    STATUS(405, "Method Not Allowed"),
+    STATUS(406, "Not Acceptable"),
+    STATUS(407, "Proxy Authentication Required"),
+    STATUS(408, "Request Timeout"),
+    STATUS(409, "Conflict"),
+    STATUS(410, "Gone"),
+    STATUS(411, "Length Required"),
+    STATUS(412, "Precondition Failed"),
+    STATUS(413, "Payload Too Large"),
+    STATUS(414, "URI Too Long"),
+    STATUS(415, "Unsupported Media Type"),
+    STATUS(416, "Range Not Satisfiable"),
+    STATUS(417, "Expectation Failed"),
+    STATUS(418, "I'm a teapot"),
+    STATUS(421, "Misdirected Request"),
+    STATUS(422, "Unprocessable Content"),
+    STATUS(423, "Locked"),
+    STATUS(424, "Failed Dependency"),
+    STATUS(425, "Too Early"),
+    STATUS(426, "Upgrade Required"),
+    STATUS(428, "Precondition Required"),
+    STATUS(429, "Too Many Requests"),
+    STATUS(431, "Request Header Fields Too Large"),
+    STATUS(451, "Unavailable For Legal Reasons"),
+    STATUS(500, "Internal Server Error"),
+    STATUS(501, "Not Implemented"),
+    STATUS(502, "Bad Gateway"),
+    STATUS(503, "Service Unavailable"),
+    STATUS(504, "Gateway Timeout"),
+    STATUS(505, "HTTP Version Not Supported"),
+    STATUS(506, "Variant Also Negotiates"),
+    STATUS(507, "Insufficient Storage"),
+    STATUS(508, "Loop Detected"),
+    STATUS(510, "Not Extended"),
+    STATUS(511, "Network Authentication Required"),
+};
+
+#undef STATUS
+
+/* Returns "HTTP/1.1 <code> <reason>\r\n" for status, or NULL when the
+ * code is not registered. */
+const char *lw_status_line(int status, size_t *len) {
+    if (status < 100 || status > 599 || !status_lines[status - 100].line)
+        return NULL;
+    *len = status_lines[status - 100].len;
+    return status_lines[status - 100].line;
+}
+
+/* Bodies compressed per request go through here first, since the
+ * Content-Length header needs the compressed size. */
+static __thread lw_buf_t compress_scratch;
+
+#define LW_SCRATCH_KEEP (1024 * 1024)
+
+// Swaps the compressed bytes in as the body; the old buffer becomes scratch
+static int take_scratch(http_response_t *response) {
+    if (response->arena) {
+        // Arena memory can't be realloc'd, copy the (smaller) result instead
+        char *zbody = lw_arena_alloc(response->arena, compress_scratch.len);
+        if (!zbody) return -1;
+        memcpy(zbody, compress_scratch.data, compress_scratch.len);
+        response->body = zbody;
+        response->body_length = compress_scratch.len;
+        return 0;
     }
 
-    route_t *route = &lw_ctx.routes[lw_ctx.route_count];
-    route->method = method;
-    strncpy(route->path, path, MAX_PATH_LENGTH - 1);
-    route->path[MAX_PATH_LENGTH - 1] = '\0';
-    route->handler = handler;
+    char *old = response->body;
+    size_t old_len = response->body_length;
 
-    lw_ctx.route_count++;
+    response->body = compress_scratch.data;
+    response->body_length = compress_scratch.len;
 
-    LW_VERBOSE ? printf("[LW] Route registered: %s %s\n", method_to_string(method), path) : 0;
+    compress_scratch.data = old;
+    compress_scratch.cap = old_len;
+    compress_scratch.len = 0;
+    return 0;
 }
 
-void lw_send_response(http_response_t *response, int client_socket, SSL *client_ssl, const char *accept_encoding) {
+/* Appends the status line and headers to out and moves the body, if any,
+ * into *body so it can be written from where it is without a copy.
+ * File bodies and streams stay on the response for the caller. A
+ * head_only response keeps its Content-Length but its body, file
+ * included, is dropped here. */
+int lw_serialize_head(http_response_t *response, const char *accept_encoding, lw_buf_t *out, lw_seg_t *body) {
     (LW_VERBOSE) ? printf("[COMP] LW_COMPRESS=%d  Accept-Encoding=%s  body=%zu\n",
        LW_COMPRESS, accept_encoding ? accept_encoding : "NULL", response->body_length) : 1;
-    if (LW_COMPRESS &&
-        response->body &&
-        response->body_length > 0 &&
-        accept_encoding &&
-        strstr(accept_encoding, "zstd")) {
-
-        size_t bound = ZSTD_compressBound(response->body_length);
-        void  *zbuf  = malloc(bound);
-        if (!zbuf) goto no_compress;
-
-        size_t zlen = ZSTD_compress(zbuf, bound,
-                                    response->body,
-                                    response->body_length,
-                                    3);                 // level 1-22
-        if (ZSTD_isError(zlen)) {
-            free(zbuf);
-            goto no_compress;
-        }
+    memset(body, 0, sizeof(*body));
 
-        char hdr[2048];
-        int  hoff = snprintf(hdr, sizeof(hdr),
-                             "HTTP/1.1 %d %s\r\n"
-                             "Content-Encoding: zstd\r\n"
-                             "Content-Length: %zu\r\n",
-                             response->status_code,
-                             response->status_code == 200 ? "OK" :
-                             response->status_code == 404 ? "Not Found" :
-                             response->status_code == 500 ? "Internal Server Error" :
-                             "Unknown",
-                             zlen);
-
-        for (int i = 0; i < response->header_count; ++i)
-            hoff += snprintf(hdr + hoff, sizeof(hdr) - hoff,
-                             "%s\r\n", response->headers[i]);
-        hoff += snprintf(hdr + hoff, sizeof(hdr) - hoff, "\r\n");
-
-        if (LW_SSL_ENABLED && client_ssl) {
-            SSL_write(client_ssl, hdr, hoff);
-            SSL_write(client_ssl, zbuf, zlen);
-        } else {
-            write(client_socket, hdr, hoff);
-            write(client_socket, zbuf, zlen);
-        }
+    lw_encoding_t encoding = LW_COMPRESS ? lw_pick_encoding(accept_encoding) : LW_ENC_IDENTITY;
+    const char *content_type = lw_get_response_header(response, "Content-Type");
+    int vary = response->encoding != LW_ENC_IDENTITY;
 
-        free(zbuf);
-        return;
+    if (LW_COMPRESS && response->body_cached && !vary &&
+        lw_compressible(response->body_cached->mime)) {
+        // Cached files are compressed once and then served as is
+        lw_cache_entry_t *entry = response->body_cached;
+        if (encoding != LW_ENC_IDENTITY && lw_cache_encode(entry, encoding) == 0) {
+            response->body = entry->variants[encoding].data;
+            response->body_length = entry->variants[encoding].size;
+            response->encoding = encoding;
+        }
+        vary = 1;
+    } else if (LW_COMPRESS && !vary && !response->body_cached &&
+               response->body_fd < 0 && response->body && response->body_length > 0 &&
+               (!content_type || lw_compressible(content_type))) {
+        compress_scratch.len = 0;
+        uint64_t started = lw_now_ns();
+        if (encoding != LW_ENC_IDENTITY &&
+            lw_compress(encoding, 0, response->body, response->body_length, &compress_scratch) == 0) {
+            lw_metrics_compress(response->body_length, compress_scratch.len, lw_now_ns() - started);
+            if (compress_scratch.len < response->body_length && take_scratch(response) == 0)
+                response->encoding = encoding;
+        }
+        if (compress_scratch.cap > LW_SCRATCH_KEEP) lw_buf_free(&compress_scratch);
+        vary = 1;
     }
 
-no_compress:
-    char response_buffer[BUFFER_SIZE * 2];
-    int offset = 0;
+    size_t line_len;
+    const char *line = lw_status_line(response->status_code, &line_len);
+    if (line) lw_buf_append(out, line, line_len);
+    else lw_buf_printf(out, "HTTP/1.1 %d Unknown\r\n", response->status_code);
 
-    offset += snprintf(response_buffer + offset,
-                       sizeof(response_buffer) - offset,
-                       "HTTP/1.1 %d %s\r\n",
-                       response->status_code,
-                       response->status_code == 200 ? "OK" :
-                       response->status_code == 404 ? "Not Found" :
-                       response->status_code == 500 ? "Internal Server Error" :
-                       "Unknown");
+    if (response->encoding != LW_ENC_IDENTITY)
+        lw_buf_printf(out, "Content-Encoding: %s\r\n", lw_encoding_name(response->encoding));
+    if (vary || response->vary)
+        lw_buf_append(out, "Vary: Accept-Encoding\r\n", 23);
 
     // Headers
     for (int i = 0; i < response->header_count; ++i)
-        offset += snprintf(response_buffer + offset,
-                           sizeof(response_buffer) - offset,
-                           "%s\r\n", response->headers[i]);
-
-    // Content-Length (uncompressed)
-    if (response->body && response->body_length > 0)
-        offset += snprintf(response_buffer + offset,
-                           sizeof(response_buffer) - offset,
-                           "Content-Length: %zu\r\n",
-                           response->body_length);
-
-    offset += snprintf(response_buffer + offset,
-                       sizeof(response_buffer) - offset,
-                       "\r\n");
-
-    // Body
-    if (response->body && response->body_length > 0) {
-        memcpy(response_buffer + offset,
-               response->body,
-               response->body_length);
-        offset += response->body_length;
+        lw_buf_printf(out, "%s\r\n", response->headers[i]);
+
+    // Framing, always sent so keep-alive peers can find the end of the reply.
+    // An HTTP/1.0 stream has none, it ends when the connection does
+    int status = response->status_code;
+    int has_body = response->body || response->body_fd >= 0;
+    if (response->transfer_chunked)
+        lw_buf_append(out, "Transfer-Encoding: chunked\r\n", 28);
+    else if (!response->stream && status >= 200 && status != 204 && status != 304)
+        lw_buf_printf(out, "Content-Length: %zu\r\n", has_body ? response->body_length : 0);
+
+    if (lw_buf_append(out, "\r\n", 2) < 0) return -1;
+
+    if (response->head_only) {
+        if (response->body_fd >= 0) close(response->body_fd);
+        response->body_fd = -1;
+        return 0;   // free_response releases the rest
+    }
+
+    if (response->body_fd >= 0 || response->transfer_chunked || response->stream ||
+        !response->body || response->body_length == 0)
+        return 0;
+
+    // The body changes hands, free_response will not touch it
+    body->data = response->body;
+    body->len = response->body_length;
+    if (response->body_cached) body->entry = response->body_cached;
+    else if (!response->arena) body->owned = response->body;
+    response->body = NULL;
+    response->body_cached = NULL;
+    return 0;
+}
+
+void lw_seg_release(lw_seg_t *seg) {
+    if (seg->entry) lw_cache_release(seg->entry);
+    free(seg->owned);
+    memset(seg, 0, sizeof(*seg));
+}
+
+/* Serializes the whole response, body included, into out. */
+int lw_serialize_response(http_response_t *response, const char *accept_encoding, lw_buf_t *out) {
+    lw_seg_t body;
+    if (lw_serialize_head(response, accept_encoding, out, &body) < 0) return -1;
+
+    int rc = body.len ? lw_buf_append(out, body.data, body.len) : 0;
+    lw_seg_release(&body);
+    return rc;
+}
+
+/* Blocking variant for callers outside the event loop. Headers and body
+ * leave in one writev (or back to back SSL_writes), never copied together. */
+void lw_send_response(http_response_t *response, int client_socket, SSL *client_ssl, const char *accept_encoding) {
+    lw_buf_t out = {0};
+    lw_seg_t body;
+    if (lw_serialize_head(response, accept_encoding, &out, &body) < 0) {
+        fprintf(stderr, "[ERR] Failed to serialize response\n");
+        lw_buf_free(&out);
+        return;
+    }
+
+    int use_ssl = LW_SSL_ENABLED && client_ssl;
+    struct iovec iov[2] = {
+        { out.data, out.len },
+        { (void *)body.data, body.len },
+    };
+    int iov_count = body.len ? 2 : 1;
+    int ok = 1;
+
+    for (int i = 0; ok && use_ssl && i < iov_count; i++) {
+        size_t off = 0;
+        while (off < iov[i].iov_len) {
+            int n = SSL_write(client_ssl, (char *)iov[i].iov_base + off, iov[i].iov_len - off);
+            if (n <= 0) { ok = 0; break; }
+            off += n;
+        }
+    }
+
+    struct iovec *cur = iov;
+    while (ok && !use_ssl && iov_count > 0) {
+        ssize_t n = writev(client_socket, cur, iov_count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { ok = 0; break; }
+
+        // Skip what went out, a partial write can end anywhere
+        while (iov_count > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+
+    if (ok && response->body_fd >= 0) {
+        off_t file_off = response->body_offset;
+        size_t left = response->body_length;
+
+        // Plain sockets let the kernel copy from the page cache
+        while (!use_ssl && left > 0) {
+            ssize_t n = sendfile(client_socket, response->body_fd, &file_off, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            left -= n;
+        }
+
+        char chunk[16384];
+        while (use_ssl && left > 0) {
+            ssize_t n = pread(response->body_fd, chunk,
+                              left < sizeof(chunk) ? left : sizeof(chunk), file_off);
+            if (n <= 0 || SSL_write(client_ssl, chunk, n) <= 0) break;
+            file_off += n;
+            left -= n;
+        }
     }
 
-    // Send
-    if (LW_SSL_ENABLED && client_ssl)
-        SSL_write(client_ssl, response_buffer, offset);
-    else
-        write(client_socket, response_buffer, offset);
+    lw_seg_release(&body);
+    lw_buf_free(&out);
 }
 
 void lw_set_header(http_response_t *response, const char *header) {
@@ -120,25 +295,65 @@ void lw_set_header(http_response_t *response, const char *header) {
         return;
     }
 
-    response->headers[response->header_count] = malloc(strlen(header) + 1);
-    strcpy(response->headers[response->header_count], header);
-    response->header_count++;
+    char *copy = response->arena ? lw_arena_strdup(response->arena, header) : strdup(header);
+    if (!copy) return;
+    response->headers[response->header_count++] = copy;
 }
 
-void lw_set_body(http_response_t *response, const char *body) {
-    if (response->body)
+static void clear_body(http_response_t *response) {
+    if (response->body_cached)
+        lw_cache_release(response->body_cached);
+    else if (response->body && !response->arena)
         free(response->body);
+    response->body = NULL;
+    response->body_cached = NULL;
+    response->encoding = LW_ENC_IDENTITY;
 
-    response->body_length = strlen(body);
-    response->body = malloc(response->body_length + 1);
-    strcpy(response->body, body);
+    if (response->body_fd >= 0)
+        close(response->body_fd);
+    response->body_fd = -1;
 }
 
-void lw_set_body_bin(http_response_t *response, const char *body, size_t length) {
-    if (response->body)
-        free(response->body);
+static char *body_alloc(http_response_t *response, size_t n) {
+    return response->arena ? lw_arena_alloc(response->arena, n) : malloc(n);
+}
+
+void lw_set_body(http_response_t *response, const char *body) {
+    clear_body(response);
 
+    size_t length = strlen(body);
+    response->body = body_alloc(response, length + 1);
+    if (!response->body) return;
+    memcpy(response->body, body, length + 1);
     response->body_length = length;
-    response->body = malloc(length);
+}
+
+void lw_set_body_bin(http_response_t *response, const char *body, size_t length) {
+    clear_body(response);
+
+    response->body = body_alloc(response, length);
+    if (!response->body) return;
     memcpy(response->body, body, length);
+    response->body_length = length;
+}
+
+/* The response takes ownership of fd and closes it when done. The bytes
+ * never pass through userspace on plain HTTP connections. */
+void lw_set_body_fd(http_response_t *response, int fd, off_t offset, size_t length) {
+    clear_body(response);
+
+    response->body_fd = fd;
+    response->body_offset = offset;
+    response->body_length = length;
+}
+
+/* Borrows the entry's bytes instead of copying them; the reference taken
+ * by lw_cache_get is dropped when the response is freed. With -c the
+ * serializer swaps in a precompressed variant the client accepts. */
+void lw_set_body_cached(http_response_t *response, lw_cache_entry_t *entry) {
+    clear_body(response);
+
+    response->body_cached = entry;
+    response->body = entry->data;
+    response->body_length = entry->size;
 }
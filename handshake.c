@@ -0,0 +1,138 @@
+#include "run.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+
+/* Optional pool that runs SSL_accept off the event loops. A handshake
+ * step with a private-key signature costs milliseconds; here it only
+ * stalls a pool thread, never the established connections of a loop.
+ * A connection is owned by exactly one thread at a time: the loop hands
+ * it over, ignores its events, and takes it back through loop->hs_wake. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    lw_conn_t *head, *tail;     /* queued steps, linked through hs_next */
+    pthread_t *threads;
+    int started;
+    int stopping;
+} pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+};
+
+static void step_done(lw_conn_t *conn) {
+    lw_loop_t *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->hs_mutex);
+    conn->hs_next = loop->hs_done;
+    loop->hs_done = conn;
+    pthread_mutex_unlock(&loop->hs_mutex);
+
+    uint64_t one = 1;
+    while (write(loop->hs_wake.fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void *pool_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.mutex);
+        while (!pool.head && !pool.stopping) pthread_cond_wait(&pool.cond, &pool.mutex);
+        if (pool.stopping) {
+            pthread_mutex_unlock(&pool.mutex);
+            return NULL;
+        }
+        lw_conn_t *conn = pool.head;
+        pool.head = conn->hs_next;
+        if (!pool.head) pool.tail = NULL;
+        pthread_mutex_unlock(&pool.mutex);
+
+        conn->hs_rc = lw_tls_accept(conn->ssl);
+        step_done(conn);
+    }
+    return NULL;
+}
+
+int lw_handshake_pool_start(int threads) {
+    if (threads <= 0) return 0;
+    pool.threads = calloc(threads, sizeof(*pool.threads));
+    if (!pool.threads) return 0;
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool.threads[i], NULL, pool_main, NULL) != 0) {
+            perror("[ERR] Could not create handshake thread");
+            break;
+        }
+        pool.started++;
+    }
+    if (pool.started)
+        printf("[LW] %d TLS handshake thread%s\n", pool.started, pool.started == 1 ? "" : "s");
+    return pool.started;
+}
+
+/* Lets every pool thread finish its current step and joins them; steps
+ * still queued are handed back as failed. Call once the loops have
+ * returned and before they are closed, so each connection is back with
+ * its loop for lw_loop_close. */
+void lw_handshake_pool_stop(void) {
+    if (!pool.started) return;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i = 0; i < pool.started; i++) pthread_join(pool.threads[i], NULL);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.started = 0;
+
+    lw_conn_t *conn = pool.head;
+    pool.head = pool.tail = NULL;
+    while (conn) {
+        lw_conn_t *next = conn->hs_next;
+        conn->hs_rc = -1;
+        step_done(conn);
+        conn = next;
+    }
+}
+
+int lw_handshake_pool_enabled(void) {
+    return pool.started > 0;
+}
+
+/* Hands the next handshake step to the pool; the loop must not touch
+ * conn until it comes back through lw_handshake_collect. */
+void lw_handshake_submit(lw_conn_t *conn) {
+    conn->hs_offloaded = 1;
+    conn->hs_pending = 0;
+    conn->hs_next = NULL;
+
+    pthread_mutex_lock(&pool.mutex);
+    if (pool.tail) pool.tail->hs_next = conn;
+    else pool.head = conn;
+    pool.tail = conn;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/* Takes back every connection whose step finished, in no particular order. */
+lw_conn_t *lw_handshake_collect(lw_loop_t *loop) {
+    uint64_t count;
+    while (read(loop->hs_wake.fd, &count, sizeof(count)) > 0);
+
+    pthread_mutex_lock(&loop->hs_mutex);
+    lw_conn_t *done = loop->hs_done;
+    loop->hs_done = NULL;
+    pthread_mutex_unlock(&loop->hs_mutex);
+    return done;
+}
+
+int lw_handshake_loop_init(lw_loop_t *loop) {
+    loop->hs_wake.kind = LW_EV_HANDSHAKE;
+    loop->hs_wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->hs_wake.fd < 0) {
+        perror("[ERR] eventfd failed");
+        return -1;
+    }
+    pthread_mutex_init(&loop->hs_mutex, NULL);
+    return 0;
+}
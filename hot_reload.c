@@ -10,7 +10,6 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
-#include <signal.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <sys/select.h>
@@ -24,7 +23,6 @@ HotReloadState hot_reload_state = {
     .inotify_fd = -1,
     .shutdown_requested = 0,
     .reload_needed = 0,
-    .reload_pipe = {-1, -1},
     .last_change_time = 0
 };
 
@@ -32,23 +30,23 @@ static void* file_watcher_thread(void* arg);
 static void add_watch(const char* path);
 static int is_temp_file(const char* filename);
 static void shutdown_hot_reload(void);
-static void signal_handler(int signum);
 
-static void notify_reload(void) {
+// Every page listening on LW_RELOAD_PATH reloads, whichever worker serves it
+static void notify_reload(const char *name) {
     hot_reload_state.last_change_time = time(NULL);
-    printf("[DEV] File change detected - reload pending\n");
-    
-    char sig = 'R';
-    write(hot_reload_state.reload_pipe[1], &sig, 1);
+    int loops = lw_broadcast(LW_RELOAD_CHANNEL, name);
+    printf("[DEV] File change detected - reload sent to %d worker%s\n", loops, loops == 1 ? "" : "s");
 }
 
 static void add_watch(const char* path) {
     if (!path || strlen(path) == 0) return;
     
-    printf("[DEV] Adding watch for: %s\n", path);
+    (LW_DEV_MODE || LW_VERBOSE) ? printf("[DEV] Adding watch for: %s\n", path) : 0;
 
     int wd = inotify_add_watch(hot_reload_state.inotify_fd, path,
-                               IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVE);
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                               IN_CREATE | IN_DELETE | IN_MOVE |
+                               IN_DELETE_SELF | IN_MOVE_SELF);
     if (wd < 0) {
         printf("[ERR] Failed to add watch for %s: %s\n", path, strerror(errno));
         return;
@@ -98,6 +96,22 @@ static void add_watches_recursive(const char* path) {
     closedir(dir);
 }
 
+// Joins the watched directory of wd with name, empty if wd is unknown
+static void event_path(int wd, const char* name, char* out, size_t size) {
+    out[0] = '\0';
+    pthread_mutex_lock(&hot_reload_state.watch_mutex);
+    for (int j = 0; j < hot_reload_state.watch_count; j++) {
+        if (hot_reload_state.watch_descriptors[j].wd == wd) {
+            if (name && *name)
+                snprintf(out, size, "%s/%s", hot_reload_state.watch_descriptors[j].path, name);
+            else
+                snprintf(out, size, "%s", hot_reload_state.watch_descriptors[j].path);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hot_reload_state.watch_mutex);
+}
+
 static int is_temp_file(const char* filename) {
     if (!filename || strlen(filename) == 0) return 1;
 
@@ -116,7 +130,7 @@ static void* file_watcher_thread(void* arg) {
     char buffer[INOTIFY_BUF_LEN];
     time_t last_reload = 0;
 
-    printf("[DEV] Starting file watcher for: %s\n", watch_dir);
+    (LW_DEV_MODE || LW_VERBOSE) ? printf("[LW] Starting file watcher for: %s\n", watch_dir) : 0;
 
     hot_reload_state.inotify_fd = inotify_init1(IN_NONBLOCK); // Non-blocking
     if (hot_reload_state.inotify_fd < 0) {
@@ -130,7 +144,9 @@ static void* file_watcher_thread(void* arg) {
     }
 
     add_watches_recursive(watch_dir);
-    printf("[DEV] File watcher started with %d watches\n", hot_reload_state.watch_count);
+    lw_cache_set_watched(1);
+    (LW_DEV_MODE || LW_VERBOSE) ? printf("[LW] File watcher started with %d watches\n",
+                                         hot_reload_state.watch_count) : 0;
 
     while (!hot_reload_state.shutdown_requested) {
         fd_set read_fds;
@@ -150,7 +166,8 @@ static void* file_watcher_thread(void* arg) {
         
         if (ready == 0) {
             // Timeout
-            usleep(100000); // 100ms
+            struct timespec pause = { 0, 100000000L };  // 100ms
+            nanosleep(&pause, NULL);
             continue; 
         }
 
@@ -166,47 +183,49 @@ static void* file_watcher_thread(void* arg) {
 
         time_t current_time = time(NULL);
         int should_reload = 0;
+        char reload_name[NAME_MAX + 1] = "";
         int i = 0;
 
         while (i < length) {
             struct inotify_event* event = (struct inotify_event*)&buffer[i];
+            i += EVENT_SIZE + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, nothing cached can be trusted
+                lw_cache_clear();
+                should_reload = 1;
+                continue;
+            }
+
+            char changed[512];
+            event_path(event->wd, event->len > 0 ? event->name : NULL, changed, sizeof(changed));
+            if (changed[0]) lw_cache_invalidate(changed, (event->mask & IN_ISDIR) ||
+                                                         (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)));
 
             if (event->len > 0) {
                 if (!is_temp_file(event->name)) {
                     if (current_time - last_reload >= 1) {
-                        printf("[DEV] File changed: %s\n", event->name);
+                        LW_DEV_MODE ? printf("[DEV] File changed: %s\n", event->name) : 0;
                         should_reload = 1;
                         last_reload = current_time;
+                        snprintf(reload_name, sizeof(reload_name), "%s", event->name);
                     }
                 }
             }
 
-            if ((event->mask & IN_CREATE) && (event->mask & IN_ISDIR)) {
-                char new_dir[512] = {0};
-                pthread_mutex_lock(&hot_reload_state.watch_mutex);
-                for (int j = 0; j < hot_reload_state.watch_count; j++) {
-                    if (hot_reload_state.watch_descriptors[j].wd == event->wd) {
-                        snprintf(new_dir, sizeof(new_dir), "%s/%s",
-                                 hot_reload_state.watch_descriptors[j].path, event->name);
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&hot_reload_state.watch_mutex);
-
-                if (strlen(new_dir) > 0 && !is_temp_file(event->name)) {
-                    add_watches_recursive(new_dir);
-                }
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR) &&
+                changed[0] && !is_temp_file(event->name)) {
+                add_watches_recursive(changed);
             }
-
-            i += EVENT_SIZE + event->len;
         }
 
-        if (should_reload) {
-            notify_reload();
+        if (should_reload && LW_DEV_MODE) {
+            notify_reload(reload_name);
         }
     }
 
     printf("[DEV] File watcher shutting down\n");
+    lw_cache_set_watched(0);
     if (hot_reload_state.inotify_fd >= 0) {
         close(hot_reload_state.inotify_fd);
         hot_reload_state.inotify_fd = -1;
@@ -214,13 +233,6 @@ static void* file_watcher_thread(void* arg) {
     return NULL;
 }
 
-static void signal_handler(int signum) {
-    (void)signum;
-    printf("[DEV] Shutdown signal received\n");
-    hot_reload_state.shutdown_requested = 1;
-    shutdown_hot_reload();
-}
-
 static void shutdown_hot_reload(void) {
     printf("[DEV] Shutting down hot reload system...\n");
     hot_reload_state.shutdown_requested = 1;
@@ -230,54 +242,43 @@ static void shutdown_hot_reload(void) {
         hot_reload_state.inotify_fd = -1;
     }
 
-    // Close pipes
-    if (hot_reload_state.reload_pipe[0] != -1) {
-        close(hot_reload_state.reload_pipe[0]);
-        close(hot_reload_state.reload_pipe[1]);
-        hot_reload_state.reload_pipe[0] = -1;
-        hot_reload_state.reload_pipe[1] = -1;
-    }
-
     printf("[DEV] Hot reload system shut down\n");
 }
 
-void start_live_reload_server(int unused, const char* watch_dir) {
-    (void)unused;
-
-    pthread_t watcher_thread;
+/* Watches watch_dir recursively and invalidates cached files as they
+ * change. Dev mode additionally gets reload notifications. */
+int start_file_watcher(const char* watch_dir) {
+    static int started = 0;
     static char dir_copy[512];
+    pthread_t watcher_thread;
 
-    printf("[DEV] Initializing live reload system...\n");
-    printf("[DEV] Watch directory: %s\n", watch_dir);
-
-    // Create pipe for signaling main thread
-    if (pipe(hot_reload_state.reload_pipe)) {
-        perror("[ERR] Failed to create reload pipe");
-        return;
-    }
-
-    // Make pipe non-blocking
-    for (int i = 0; i < 2; i++) {
-        int flags = fcntl(hot_reload_state.reload_pipe[i], F_GETFL, 0);
-        fcntl(hot_reload_state.reload_pipe[i], F_SETFL, flags | O_NONBLOCK);
-    }
+    if (started) return 0;
 
     strncpy(dir_copy, watch_dir, sizeof(dir_copy) - 1);
     dir_copy[sizeof(dir_copy) - 1] = '\0';
 
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    atexit(shutdown_hot_reload);
-
     if (pthread_create(&watcher_thread, NULL, file_watcher_thread, dir_copy) != 0) {
         perror("[ERR] Could not create file watcher thread");
-        return;
+        return -1;
     }
     pthread_detach(watcher_thread);
+    started = 1;
+    return 0;
+}
+
+void start_live_reload_server(int unused, const char* watch_dir) {
+    (void)unused;
+
+    printf("[DEV] Initializing live reload system...\n");
+    printf("[DEV] Watch directory: %s\n", watch_dir);
+
+    // The watcher thread must not take the signals lw_run waits for
+    lw_block_signals();
+    atexit(shutdown_hot_reload);
+
+    if (start_file_watcher(watch_dir) < 0) return;
 
     printf("[DEV] Live reload system started\n");
 }
 
-int get_reload_pipe_fd(void) {
-    return hot_reload_state.reload_pipe[0];
-}
+
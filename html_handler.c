@@ -4,18 +4,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 extern HotReloadState hot_reload_state;
 
-static void chunked_write(int fd, const char *data, size_t len)
-{
-    char header[32];
-    int hdr_len = snprintf(header, sizeof(header), "%zx\r\n", len);
-    send(fd, header, hdr_len, MSG_NOSIGNAL);
-    send(fd, data, len, MSG_NOSIGNAL);
-    send(fd, "\r\n", 2, MSG_NOSIGNAL);
-}
-
 char* load_html_file(const char* filename) {
     char filepath[512];
     snprintf(filepath, sizeof(filepath), "./public/html/%s", filename);
@@ -35,60 +29,95 @@ char* load_html_file(const char* filename) {
     content[file_size] = '\0';
 
     fclose(file);
-    printf("[LW] HTML file loaded: %s\n", filepath);
+    (LW_VERBOSE) ? printf("[LW] HTML file loaded: %s\n", filepath) : 0;
     return content;
 }
 
 void render_html(http_response_t *res, const char *filename) {
-    if (!LW_DEV_MODE) {
-        char *content = load_html_file(filename);
-        if (!content) {
-            res->status_code = 404;
-            lw_set_header(res, "Content-Type: text/html; charset=utf-8");
-            lw_set_body(res, "<h1>404 Not Found</h1>");
-            return;
-        }
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "./public/html/%s", filename);
+
+    // The watcher drops the entry on every save, so dev mode still sees edits
+    if (LW_DEV_MODE) lw_set_header(res, "Cache-Control: no-cache");
+
+    lw_cache_entry_t *entry = lw_cache_get(filepath);
+    if (entry) {
         lw_set_header(res, "Content-Type: text/html; charset=utf-8");
-        lw_set_body(res, content);
-        free(content);
+        lw_set_body_cached(res, entry);
         return;
     }
 
-    res->status_code = 200;
+    char *content = load_html_file(filename);
+    if (!content) {
+        res->status_code = 404;
+        lw_set_header(res, "Content-Type: text/html; charset=utf-8");
+        lw_set_body(res, "<h1>404 Not Found</h1>");
+        return;
+    }
     lw_set_header(res, "Content-Type: text/html; charset=utf-8");
-    lw_set_header(res, "Transfer-Encoding: chunked");
-    lw_set_header(res, "Cache-Control: no-cache");
-    lw_set_header(res, "Connection: keep-alive");
-    
-    // Add reload header if needed
-    time_t now = time(NULL);
-    if (now - hot_reload_state.last_change_time <= 2) {
-        lw_set_header(res, "X-Reload: 1");
+    lw_set_body(res, content);
+    free(content);
+}
+
+/* Builds base/path with "//" and "/./" collapsed, so every spelling of a
+ * file shares one cache entry. */
+static void join_public_path(char *out, size_t size, const char *base, const char *path)
+{
+    size_t n = snprintf(out, size, "%s%s", base, *path == '/' ? "" : "/");
+    while (*path && n + 1 < size) {
+        if (*path == '/' && (path[1] == '/' || (path[1] == '.' && (path[2] == '/' || !path[2])))) {
+            path += path[1] == '/' ? 1 : 2;
+            continue;
+        }
+        out[n++] = *path++;
     }
+    out[n] = '\0';
+}
+
+static void set_content_type(http_response_t *res, const char *mime)
+{
+    char header[128];
+    snprintf(header, sizeof(header), "Content-Type: %s", mime);
+    lw_set_header(res, header);
+}
 
-    char header_buf[1024];
-    int off = snprintf(header_buf, sizeof(header_buf),
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/html; charset=utf-8\r\n"
-            "Transfer-Encoding: chunked\r\n"
-            "Cache-Control: no-cache\r\n"
-            "Connection: keep-alive\r\n");
-    
-    // Add custom headers
-    for (int i = 0; i < res->header_count; i++) {
-        off += snprintf(header_buf + off, sizeof(header_buf) - off, 
-                        "%s\r\n", res->headers[i]);
+// Opens path if it is a regular file at least as new as mtime
+static int open_sibling(const char *path, time_t mtime, struct stat *st)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) || st->st_mtime < mtime) {
+        close(fd);
+        return -1;
     }
-    off += snprintf(header_buf + off, sizeof(header_buf) - off, "\r\n");
-    
-    send(res->chunked_fd, header_buf, off, MSG_NOSIGNAL);
+    return fd;
+}
 
-    char *content = load_html_file(filename);
-    printf("[DEV] loaded %zu bytes\n", content ? strlen(content) : 0);
-    if (!content) content = strdup("<h1>404 Not Found</h1>");
-    chunked_write(res->chunked_fd, content, strlen(content));
-    free(content);
-    chunked_write(res->chunked_fd, "", 0);
+/* Swaps in a sibling like big.js.br or big.js.zst when one is not older
+ * than the file itself, trying every encoding the client accepts in its
+ * order of preference. */
+static void use_precompressed(http_request_t *req, http_response_t *res,
+                              const char *filepath, const struct stat *orig)
+{
+    lw_encoding_t order[LW_ENC_COUNT];
+    int count = lw_rank_encodings(lw_get_header(req, "Accept-Encoding"), order);
+
+    // Whichever body goes out, it was chosen by Accept-Encoding
+    res->vary = 1;
+
+    for (int i = 0; i < count; i++) {
+        char zpath[520];
+        if (snprintf(zpath, sizeof(zpath), "%s%s", filepath, lw_variant_suffix(order[i])) >= (int)sizeof(zpath))
+            continue;
+
+        struct stat st;
+        int fd = open_sibling(zpath, orig->st_mtime, &st);
+        if (fd < 0) continue;
+
+        lw_set_body_fd(res, fd, 0, st.st_size);
+        res->encoding = order[i];
+        return;
+    }
 }
 
 void static_file_handler(http_request_t *req, http_response_t *res)
@@ -103,77 +132,37 @@ void static_file_handler(http_request_t *req, http_response_t *res)
         return;
     }
 
-    const char *path = req->path;
-    if (*path == '/') path++;
-    snprintf(filepath, sizeof(filepath), "%s/%s", base_path, path);
+    join_public_path(filepath, sizeof(filepath), base_path, req->path);
 
-    FILE *file = fopen(filepath, "rb");
-    if (file == NULL) {
-        res->status_code = 404;
-        lw_set_header(res, "Content-Type: text/html");
-        lw_set_body(res, "<h1>404 Not Found</h1>");
-        return;
-    }
-
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    char *content = malloc(file_size);
-    if (!content) {
-        fclose(file);
-        res->status_code = 500;
-        lw_set_body(res, "Internal Server Error");
-        return;
-    }
-
-    size_t bytes_read = fread(content, 1, file_size, file);
-    fclose(file);
-    if (bytes_read != (size_t)file_size) {
-        free(content);
-        res->status_code = 500;
-        lw_set_body(res, "Internal Server Error");
-        return;
+    // Hot assets are answered from memory without touching the filesystem
+    lw_cache_entry_t *entry = lw_cache_get(filepath);
+    int fd = -1;
+    struct stat st;
+    if (!entry) {
+        fd = open(filepath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) close(fd);
+            res->status_code = 404;
+            lw_set_header(res, "Content-Type: text/html");
+            lw_set_body(res, "<h1>404 Not Found</h1>");
+            return;
+        }
     }
 
-    const char *ext = strrchr(filepath, '.');
-    if (ext) {
-        if      (strcmp(ext, ".css") == 0)       lw_set_header(res, "Content-Type: text/css");
-        else if (strcmp(ext, ".js")  == 0)       lw_set_header(res, "Content-Type: application/javascript");
-        else if (strcmp(ext, ".png")  == 0)      lw_set_header(res, "Content-Type: image/png");
-        else if (strcmp(ext, ".jpg")  == 0 ||
-                 strcmp(ext, ".jpeg") == 0)      lw_set_header(res, "Content-Type: image/jpeg");
-        else if (strcmp(ext, ".gif")  == 0)      lw_set_header(res, "Content-Type: image/gif");
-        else if (strcmp(ext, ".svg")  == 0)      lw_set_header(res, "Content-Type: image/svg+xml");
-        else if (strcmp(ext, ".ico")  == 0)      lw_set_header(res, "Content-Type: image/x-icon");
-        else if (strcmp(ext, ".woff2") == 0)     lw_set_header(res, "Content-Type: font/woff2");
-        else if (strcmp(ext, ".woff")  == 0)     lw_set_header(res, "Content-Type: font/woff");
-        else if (strcmp(ext, ".ttf")   == 0)     lw_set_header(res, "Content-Type: font/ttf");
-        else if (strcmp(ext, ".otf")   == 0)     lw_set_header(res, "Content-Type: font/otf");
-        else if (strcmp(ext, ".eot")   == 0)     lw_set_header(res, "Content-Type: application/vnd.ms-fontobject");
-        else if (strcmp(ext, ".json")  == 0)     lw_set_header(res, "Content-Type: application/json");
-        else if (strcmp(ext, ".xml")   == 0)     lw_set_header(res, "Content-Type: application/xml");
-        else if (strcmp(ext, ".pdf")   == 0)     lw_set_header(res, "Content-Type: application/pdf");
-        else if (strcmp(ext, ".zip")   == 0)     lw_set_header(res, "Content-Type: application/zip");
-        else if (strcmp(ext, ".txt")   == 0)     lw_set_header(res, "Content-Type: text/plain");
-        else                                      lw_set_header(res, "Content-Type: text/html; charset=utf-8");
-    } else {
-        lw_set_header(res, "Content-Type: text/html; charset=utf-8");
-    }
+    set_content_type(res, entry ? entry->mime : lw_mime_type(filepath));
 
     time_t now = time(NULL);
     if (now - hot_reload_state.last_change_time <= 2) {
         lw_set_header(res, "X-Reload: 1");
     }
 
-    if (LW_DEV_MODE && res->chunked_fd >= 0) {
-        chunked_write(res->chunked_fd, content, file_size);
-        chunked_write(res->chunked_fd, "", 0);
+    if (entry) {
+        lw_set_body_cached(res, entry);
     } else {
-        lw_set_body_bin(res, content, file_size);
+        // Too big to cache: sent with sendfile() by the event loop
+        lw_set_body_fd(res, fd, 0, st.st_size);
+        if (LW_COMPRESS) use_precompressed(req, res, filepath, &st);
     }
-
-    free(content);
 }
 
 void use_static_files() {
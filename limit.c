@@ -0,0 +1,72 @@
+#include "run.h"
+#include <stdint.h>
+
+/* Open connections per client address. Connections from one address are
+ * spread over every worker by SO_REUSEPORT, so the count is shared: a
+ * hash table whose buckets each have their own lock, taken once on
+ * accept and once on close. Entries are dropped when they reach zero. */
+
+#define LW_IP_BUCKETS 1024
+
+typedef struct lw_ip_entry {
+    in_addr_t addr;
+    int count;
+    struct lw_ip_entry *next;
+} lw_ip_entry_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    lw_ip_entry_t *entries;
+} buckets[LW_IP_BUCKETS];
+
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void buckets_init(void) {
+    for (int i = 0; i < LW_IP_BUCKETS; i++)
+        pthread_mutex_init(&buckets[i].mutex, NULL);
+}
+
+static int bucket_of(in_addr_t addr) {
+    return (uint32_t)(addr * 2654435761u) >> 22;   // top 10 bits
+}
+
+/* Counts one more connection from addr. Returns -1, counting nothing,
+ * when addr already has LW_MAX_PER_IP open. */
+int lw_ip_acquire(struct in_addr addr) {
+    pthread_once(&buckets_once, buckets_init);
+    int b = bucket_of(addr.s_addr);
+    int rc = 0;
+
+    pthread_mutex_lock(&buckets[b].mutex);
+    lw_ip_entry_t *e = buckets[b].entries;
+    while (e && e->addr != addr.s_addr) e = e->next;
+    if (!e) {
+        e = calloc(1, sizeof(*e));
+        if (e) {
+            e->addr = addr.s_addr;
+            e->next = buckets[b].entries;
+            buckets[b].entries = e;
+        }
+    }
+    // Out of memory: let it in rather than turn everyone away
+    if (e && e->count >= LW_MAX_PER_IP) rc = -1;
+    else if (e) e->count++;
+    pthread_mutex_unlock(&buckets[b].mutex);
+    return rc;
+}
+
+void lw_ip_release(struct in_addr addr) {
+    int b = bucket_of(addr.s_addr);
+
+    pthread_mutex_lock(&buckets[b].mutex);
+    for (lw_ip_entry_t **p = &buckets[b].entries; *p; p = &(*p)->next) {
+        lw_ip_entry_t *e = *p;
+        if (e->addr != addr.s_addr) continue;
+        if (--e->count == 0) {
+            *p = e->next;
+            free(e);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&buckets[b].mutex);
+}
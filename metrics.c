@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "run.h"
+#include <stdint.h>
+
+/* Counters and latency histograms, one set per worker. Only the owning
+ * loop writes a set, so the hot path is plain relaxed stores with no lock
+ * and no shared cache line; the metrics endpoint sums every worker when it
+ * is scraped. */
+
+// All workers' sets, for rendering
+static struct {
+    pthread_mutex_t mutex;
+    lw_metrics_t *all;          /* linked through next */
+} registry = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// The set of the loop running on this thread, NULL elsewhere
+static __thread lw_metrics_t *thread_metrics;
+
+/* Compression done off the loops, e.g. by the cache's variant builder.
+ * Any thread may add here, so these take a locked add. */
+static struct {
+    uint64_t in, out, ns;
+} offloop_compress;
+
+static const char *metrics_path;
+
+uint64_t lw_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Log-linear: values below LW_HIST_SUB microseconds get a bucket each,
+ * above that every power of two is split into LW_HIST_SUB buckets, so
+ * any value is off by at most 1/LW_HIST_SUB. */
+static int hist_bucket(uint64_t us) {
+    if (us < LW_HIST_SUB) return (int)us;
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (int)(us >> (exp - 3)) & (LW_HIST_SUB - 1);
+    int bucket = (exp - 2) * LW_HIST_SUB + sub;
+    return bucket < LW_HIST_BUCKETS ? bucket : LW_HIST_BUCKETS - 1;
+}
+
+// Smallest value that no longer falls into bucket
+static uint64_t hist_upper(int bucket) {
+    if (bucket < LW_HIST_SUB) return bucket + 1;
+    int exp = bucket / LW_HIST_SUB + 2;
+    uint64_t step = 1ull << (exp - 3);
+    return (LW_HIST_SUB + bucket % LW_HIST_SUB) * step + step;
+}
+
+void lw_hist_record(lw_hist_t *hist, uint64_t us) {
+    lw_metric_add(&hist->buckets[hist_bucket(us)], 1);
+    lw_metric_add(&hist->count, 1);
+    lw_metric_add(&hist->sum_us, us);
+}
+
+static void hist_merge(lw_hist_t *into, const lw_hist_t *from) {
+    for (int i = 0; i < LW_HIST_BUCKETS; i++)
+        into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    into->sum_us += __atomic_load_n(&from->sum_us, __ATOMIC_RELAXED);
+}
+
+// Upper bound of the bucket holding the q-th value, in seconds
+static double hist_quantile(const lw_hist_t *hist, double q) {
+    uint64_t total = 0;
+    for (int i = 0; i < LW_HIST_BUCKETS; i++) total += hist->buckets[i];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LW_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) return hist_upper(i) / 1e6;
+    }
+    return hist_upper(LW_HIST_BUCKETS - 1) / 1e6;
+}
+
+int lw_metrics_loop_init(lw_loop_t *loop) {
+    lw_metrics_t *m = calloc(1, sizeof(*m));
+    if (!m) return -1;
+
+    // Routes are registered before lw_run; the last slot counts misses
+    m->route_slots = lw_ctx.route_count + 1;
+    m->routes = calloc(m->route_slots, sizeof(*m->routes));
+    if (!m->routes) {
+        free(m);
+        return -1;
+    }
+    m->loop = loop;
+    loop->metrics = m;
+
+    pthread_mutex_lock(&registry.mutex);
+    m->next = registry.all;
+    registry.all = m;
+    pthread_mutex_unlock(&registry.mutex);
+    return 0;
+}
+
+void lw_metrics_loop_close(lw_loop_t *loop) {
+    lw_metrics_t *m = loop->metrics;
+    if (!m) return;
+
+    pthread_mutex_lock(&registry.mutex);
+    for (lw_metrics_t **p = &registry.all; *p; p = &(*p)->next) {
+        if (*p == m) {
+            *p = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry.mutex);
+
+    free(m->routes);
+    free(m);
+    loop->metrics = NULL;
+}
+
+void lw_metrics_bind(lw_metrics_t *m) {
+    thread_metrics = m;
+}
+
+void lw_metrics_request(lw_metrics_t *m, const route_t *route, int status, uint64_t ns) {
+    int slot = route ? route->id : m->route_slots - 1;
+    if (slot < m->route_slots) lw_hist_record(&m->routes[slot], ns / 1000);
+    if (status >= 100 && status < LW_METRICS_STATUS) lw_metric_add(&m->status[status], 1);
+}
+
+// Called wherever a body is compressed, on a loop or off one
+void lw_metrics_compress(size_t in, size_t out, uint64_t ns) {
+    lw_metrics_t *m = thread_metrics;
+    if (!m) {
+        __atomic_add_fetch(&offloop_compress.in, in, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&offloop_compress.out, out, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&offloop_compress.ns, ns, __ATOMIC_RELAXED);
+        return;
+    }
+    lw_metric_add(&m->compress_in, in);
+    lw_metric_add(&m->compress_out, out);
+    lw_metric_add(&m->compress_ns, ns);
+}
+
+// Route paths are the developer's, but a quote would still break the format
+static void put_label(lw_buf_t *out, const char *value) {
+    for (; *value; value++) {
+        if (*value == '"' || *value == '\\') lw_buf_append(out, "\\", 1);
+        lw_buf_append(out, value, 1);
+    }
+}
+
+// method="GET",route="/users/:id", or route="unmatched" for 404s
+static void put_route_labels(lw_buf_t *out, const route_t *route) {
+    if (route) lw_buf_printf(out, "method=\"%s\",", method_to_string(route->method));
+    lw_buf_append(out, "route=\"", 7);
+    put_label(out, route ? route->path : "unmatched");
+    lw_buf_append(out, "\"", 1);
+}
+
+static void put_summary(lw_buf_t *out, const char *name, const char *labels, const lw_hist_t *hist) {
+    static const struct { const char *label; double q; } quantiles[] = {
+        { "0.5", 0.5 }, { "0.9", 0.9 }, { "0.99", 0.99 }, { "0.999", 0.999 },
+    };
+    const char *sep = *labels ? "," : "";
+
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        lw_buf_printf(out, "%s{%s%squantile=\"%s\"} %.6f\n", name, labels, sep,
+                      quantiles[i].label, hist_quantile(hist, quantiles[i].q));
+    const char *open = *labels ? "{" : "", *close = *labels ? "}" : "";
+    lw_buf_printf(out, "%s_sum%s%s%s %.6f\n", name, open, labels, close, hist->sum_us / 1e6);
+    lw_buf_printf(out, "%s_count%s%s%s %llu\n", name, open, labels, close,
+                  (unsigned long long)hist->count);
+}
+
+/* Sums every worker into Prometheus' text format. */
+int lw_metrics_render(lw_buf_t *out) {
+    uint64_t bytes_in = 0, bytes_out = 0, parse_errors = 0, active = 0;
+    uint64_t compress_in = 0, compress_out = 0, compress_ns = 0;
+    uint64_t status[LW_METRICS_STATUS] = {0};
+    uint64_t timeouts[LW_TIMEOUT_KINDS] = {0}, per_ip_rejected = 0;
+    int slots = lw_ctx.route_count + 1;
+    lw_hist_t *routes = calloc(slots, sizeof(*routes));
+    lw_hist_t *tls = calloc(1, sizeof(*tls));
+    if (!routes || !tls) {
+        free(routes);
+        free(tls);
+        return -1;
+    }
+
+    pthread_mutex_lock(&registry.mutex);
+    for (lw_metrics_t *m = registry.all; m; m = m->next) {
+        bytes_in += __atomic_load_n(&m->bytes_in, __ATOMIC_RELAXED);
+        bytes_out += __atomic_load_n(&m->bytes_out, __ATOMIC_RELAXED);
+        parse_errors += __atomic_load_n(&m->parse_errors, __ATOMIC_RELAXED);
+        compress_in += __atomic_load_n(&m->compress_in, __ATOMIC_RELAXED);
+        compress_out += __atomic_load_n(&m->compress_out, __ATOMIC_RELAXED);
+        compress_ns += __atomic_load_n(&m->compress_ns, __ATOMIC_RELAXED);
+        active += __atomic_load_n(&m->loop->conn_count, __ATOMIC_RELAXED);
+        for (int i = 0; i < LW_METRICS_STATUS; i++)
+            status[i] += __atomic_load_n(&m->status[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < LW_TIMEOUT_KINDS; i++)
+            timeouts[i] += __atomic_load_n(&m->timeouts[i], __ATOMIC_RELAXED);
+        per_ip_rejected += __atomic_load_n(&m->per_ip_rejected, __ATOMIC_RELAXED);
+
+        // A route registered after this worker started has no slot in it
+        for (int i = 0; i < slots && i < m->route_slots; i++) {
+            int slot = i == m->route_slots - 1 ? slots - 1 : i;
+            hist_merge(&routes[slot], &m->routes[i]);
+        }
+        hist_merge(tls, &m->tls_handshake);
+    }
+    pthread_mutex_unlock(&registry.mutex);
+    compress_in += __atomic_load_n(&offloop_compress.in, __ATOMIC_RELAXED);
+    compress_out += __atomic_load_n(&offloop_compress.out, __ATOMIC_RELAXED);
+    compress_ns += __atomic_load_n(&offloop_compress.ns, __ATOMIC_RELAXED);
+
+    lw_buf_t labels = {0};
+    lw_buf_printf(out, "# HELP lw_request_duration_seconds From parsed head to queued response, by route.\n"
+                       "# TYPE lw_request_duration_seconds summary\n");
+    for (int i = 0; i < slots; i++) {
+        if (!routes[i].count) continue;
+        labels.len = 0;
+        put_route_labels(&labels, i < slots - 1 ? lw_route_at(i) : NULL);
+        if (lw_buf_append(&labels, "", 1) < 0) break;
+        put_summary(out, "lw_request_duration_seconds", labels.data, &routes[i]);
+    }
+    lw_buf_free(&labels);
+
+    lw_buf_printf(out, "# TYPE lw_responses_total counter\n");
+    for (int i = 0; i < LW_METRICS_STATUS; i++)
+        if (status[i]) lw_buf_printf(out, "lw_responses_total{code=\"%d\"} %llu\n", i, (unsigned long long)status[i]);
+
+    lw_buf_printf(out, "# HELP lw_timeouts_total Connections closed because a timeout ran out, by phase.\n"
+                       "# TYPE lw_timeouts_total counter\n");
+    for (int i = LW_TIMEOUT_NONE + 1; i < LW_TIMEOUT_KINDS; i++)
+        lw_buf_printf(out, "lw_timeouts_total{phase=\"%s\"} %llu\n", lw_timeout_names[i],
+                      (unsigned long long)timeouts[i]);
+    if (LW_MAX_PER_IP > 0)
+        lw_buf_printf(out, "# TYPE lw_per_ip_rejected_total counter\nlw_per_ip_rejected_total %llu\n",
+                      (unsigned long long)per_ip_rejected);
+
+    lw_buf_printf(out,
+        "# TYPE lw_received_bytes_total counter\nlw_received_bytes_total %llu\n"
+        "# TYPE lw_sent_bytes_total counter\nlw_sent_bytes_total %llu\n"
+        "# TYPE lw_parse_errors_total counter\nlw_parse_errors_total %llu\n"
+        "# TYPE lw_connections_active gauge\nlw_connections_active %llu\n"
+        "# TYPE lw_compress_input_bytes_total counter\nlw_compress_input_bytes_total %llu\n"
+        "# TYPE lw_compress_output_bytes_total counter\nlw_compress_output_bytes_total %llu\n"
+        "# TYPE lw_compress_seconds_total counter\nlw_compress_seconds_total %.6f\n"
+        "# TYPE lw_compress_ratio gauge\nlw_compress_ratio %.4f\n",
+        (unsigned long long)bytes_in, (unsigned long long)bytes_out,
+        (unsigned long long)parse_errors, (unsigned long long)active,
+        (unsigned long long)compress_in, (unsigned long long)compress_out,
+        compress_ns / 1e9, compress_out ? (double)compress_in / compress_out : 0);
+
+    if (LW_SSL_ENABLED) {
+        unsigned long full, resumed;
+        lw_tls_stats(&full, &resumed);
+        lw_buf_printf(out,
+            "# TYPE lw_tls_handshakes_total counter\n"
+            "lw_tls_handshakes_total{type=\"full\"} %lu\n"
+            "lw_tls_handshakes_total{type=\"resumed\"} %lu\n"
+            "# TYPE lw_tls_handshake_seconds summary\n", full, resumed);
+        put_summary(out, "lw_tls_handshake_seconds", "", tls);
+    }
+
+    free(routes);
+    free(tls);
+    return 0;
+}
+
+static void metrics_handler(http_request_t *req, http_response_t *res) {
+    (void)req;
+    lw_buf_t out = {0};
+    if (lw_metrics_render(&out) < 0) {
+        res->status_code = 500;
+        lw_set_body(res, "Out of memory");
+        return;
+    }
+    lw_set_header(res, "Content-Type: text/plain; version=0.0.4");
+    lw_set_body_bin(res, out.data, out.len);
+    lw_buf_free(&out);
+}
+
+/* Serves the metrics at path. Call before lw_run. */
+void lw_metrics_use(const char *path) {
+    if (metrics_path) return;
+    metrics_path = path;
+    lw_route(GET, path, metrics_handler);
+}
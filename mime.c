@@ -0,0 +1,113 @@
+#include "run.h"
+#include <ctype.h>
+
+#define MIME_SLOTS   256    /* power of two, kept under half full */
+#define MIME_EXT_MAX 16
+
+/* Anything without a known extension is served as a page. */
+#define MIME_DEFAULT "text/html; charset=utf-8"
+
+static const struct {
+    const char *ext;
+    const char *type;
+} builtin_types[] = {
+    { "html",  "text/html; charset=utf-8" },
+    { "htm",   "text/html; charset=utf-8" },
+    { "css",   "text/css" },
+    { "js",    "application/javascript" },
+    { "mjs",   "application/javascript" },
+    { "json",  "application/json" },
+    { "map",   "application/json" },
+    { "xml",   "application/xml" },
+    { "txt",   "text/plain" },
+    { "png",   "image/png" },
+    { "jpg",   "image/jpeg" },
+    { "jpeg",  "image/jpeg" },
+    { "gif",   "image/gif" },
+    { "svg",   "image/svg+xml" },
+    { "ico",   "image/x-icon" },
+    { "webp",  "image/webp" },
+    { "avif",  "image/avif" },
+    { "woff2", "font/woff2" },
+    { "woff",  "font/woff" },
+    { "ttf",   "font/ttf" },
+    { "otf",   "font/otf" },
+    { "eot",   "application/vnd.ms-fontobject" },
+    { "wasm",  "application/wasm" },
+    { "pdf",   "application/pdf" },
+    { "zip",   "application/zip" },
+    { "mp4",   "video/mp4" },
+    { "webm",  "video/webm" },
+    { "mp3",   "audio/mpeg" },
+};
+
+/* Open addressing on the lowercased extension. Filled once before the
+ * workers start and only read afterwards, so lookups take no lock. */
+static struct {
+    char ext[MIME_EXT_MAX];
+    const char *type;
+} slots[MIME_SLOTS];
+static int slot_count;
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static unsigned hash_ext(const char *ext) {
+    unsigned h = 2166136261u;   // FNV-1a
+    while (*ext) {
+        h ^= (unsigned char)*ext++;
+        h *= 16777619u;
+    }
+    return h & (MIME_SLOTS - 1);
+}
+
+// Lowercases ext into key, fails for extensions too long to be registered
+static int ext_key(const char *ext, char key[MIME_EXT_MAX]) {
+    size_t i = 0;
+    for (; ext[i]; i++) {
+        if (i == MIME_EXT_MAX - 1) return -1;
+        key[i] = tolower((unsigned char)ext[i]);
+    }
+    key[i] = '\0';
+    return i ? 0 : -1;
+}
+
+static int mime_insert(const char *ext, const char *type) {
+    char key[MIME_EXT_MAX];
+    if (ext_key(ext, key) < 0) return -1;
+
+    for (unsigned i = hash_ext(key);; i = (i + 1) & (MIME_SLOTS - 1)) {
+        if (slots[i].type && strcmp(slots[i].ext, key) != 0) continue;
+        if (!slots[i].type) {
+            if (slot_count >= MIME_SLOTS / 2) return -1;
+            slot_count++;
+        }
+        memcpy(slots[i].ext, key, sizeof(key));
+        slots[i].type = type;
+        return 0;
+    }
+}
+
+static void load_builtin_types(void) {
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++)
+        mime_insert(builtin_types[i].ext, builtin_types[i].type);
+}
+
+/* Maps ext (without the dot) to type, replacing any earlier mapping.
+ * type is not copied. Call before lw_run; lookups are not locked. */
+int lw_mime_register(const char *ext, const char *type) {
+    pthread_once(&builtin_once, load_builtin_types);
+    if (*ext == '.') ext++;
+    return mime_insert(ext, type);
+}
+
+const char *lw_mime_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) return MIME_DEFAULT;
+
+    char key[MIME_EXT_MAX];
+    if (ext_key(ext + 1, key) < 0) return MIME_DEFAULT;
+
+    pthread_once(&builtin_once, load_builtin_types);
+    for (unsigned i = hash_ext(key); slots[i].type; i = (i + 1) & (MIME_SLOTS - 1))
+        if (strcmp(slots[i].ext, key) == 0) return slots[i].type;
+    return MIME_DEFAULT;
+}
@@ -1,108 +1,337 @@
 #include "run.h"
+#include <strings.h>
+#include <limits.h>
+#include <stdint.h>
 
-http_method_t parse_method(const char *method_str) {
-    if (strncmp(method_str, "GET", 3) == 0) return GET;
-    if (strncmp(method_str, "POST", 4) == 0) return POST;
-    if (strncmp(method_str, "PUT", 3) == 0) return PUT;
-    if (strncmp(method_str, "DELETE", 6) == 0) return DELETE;
-    if (strncmp(method_str, "PATCH", 5) == 0) return PATCH;
-    if (strncmp(method_str, "HEAD", 4) == 0) return HEAD;
-    if (strncmp(method_str, "OPTIONS", 7) == 0) return OPTIONS;
+/* Switches on the token length first, so at most two compares run. */
+http_method_t lw_method_from(const char *s, size_t len) {
+    switch (len) {
+    case 3:
+        if (memcmp(s, "GET", 3) == 0) return GET;
+        if (memcmp(s, "PUT", 3) == 0) return PUT;
+        break;
+    case 4:
+        if (memcmp(s, "POST", 4) == 0) return POST;
+        if (memcmp(s, "HEAD", 4) == 0) return HEAD;
+        break;
+    case 5:
+        if (memcmp(s, "PATCH", 5) == 0) return PATCH;
+        break;
+    case 6:
+        if (memcmp(s, "DELETE", 6) == 0) return DELETE;
+        break;
+    case 7:
+        if (memcmp(s, "OPTIONS", 7) == 0) return OPTIONS;
+        break;
+    }
     return UNKNOWN;
 }
 
-void parse_request(const char *raw_request, http_request_t *request) {
-    const char *current = raw_request;
-    const char *line_end;
-    char line_buffer[2048];
-    
-    // Initialize request
-    memset(request, 0, sizeof(*request));
-    
-    // Parse request line (first line)
-    line_end = strstr(current, "\r\n");
-    if (!line_end) return;
-    
-    size_t line_len = line_end - current;
-    if (line_len >= sizeof(line_buffer)) line_len = sizeof(line_buffer) - 1;
-    strncpy(line_buffer, current, line_len);
-    line_buffer[line_len] = '\0';
-    
-    // Parse method, path, and version from request line
-    char *method_str = strtok(line_buffer, " ");
-    char *path_str = strtok(NULL, " ");
-    char *version_str = strtok(NULL, " ");
-    
-    if (method_str) {
-        request->method = parse_method(method_str);
+// Takes the method token at the start of method_str
+http_method_t parse_method(const char *method_str) {
+    return lw_method_from(method_str, strcspn(method_str, " "));
+}
+
+void lw_parser_reset(lw_parser_t *parser) {
+    memset(parser, 0, sizeof(*parser));
+    parser->state = LW_PARSE_REQUEST_LINE;
+    parser->content_length = -1;
+}
+
+// METHOD SP target SP version, the version may be missing (HTTP/0.9)
+static int parse_request_line(lw_parser_t *parser, const char *buf, size_t start, size_t end) {
+    const char *line = buf + start;
+    size_t len = end - start;
+
+    const char *sp1 = memchr(line, ' ', len);
+    if (!sp1 || sp1 == line) return -1;
+
+    const char *target = sp1 + 1;
+    const char *line_end = line + len;
+    const char *sp2 = memchr(target, ' ', line_end - target);
+    const char *target_end = sp2 ? sp2 : line_end;
+    if (target_end == target) return -1;
+
+    parser->method_str.off = start;
+    parser->method_str.len = sp1 - line;
+    parser->method = lw_method_from(line, sp1 - line);
+
+    const char *q = memchr(target, '?', target_end - target);
+    parser->path.off = target - buf;
+    parser->path.len = (q ? q : target_end) - target;
+    if (q) {
+        parser->query.off = q + 1 - buf;
+        parser->query.len = target_end - (q + 1);
+    }
+
+    // Anything that is not HTTP/1.1+ gets HTTP/1.0 connection semantics
+    const char *version = sp2 ? sp2 + 1 : NULL;
+    parser->version_minor = (version && line_end - version >= 8 &&
+                             memcmp(version, "HTTP/1.", 7) == 0 &&
+                             version[7] >= '1') ? 1 : 0;
+    return 0;
+}
+
+static int parse_header_line(lw_parser_t *parser, const char *buf, size_t start, size_t end) {
+    const char *line = buf + start;
+    const char *colon = memchr(line, ':', end - start);
+    if (!colon || colon == line) return 0;   // not a header, skip it
+
+    const char *value = colon + 1;
+    const char *value_end = buf + end;
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+    size_t name_len = colon - line;
+    if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+        long length = 0;
+        if (value == value_end) return -1;
+        for (const char *p = value; p < value_end; p++) {
+            if (*p < '0' || *p > '9' || length > (LONG_MAX - 9) / 10) return -1;
+            length = length * 10 + (*p - '0');
+        }
+        if (parser->content_length >= 0 && parser->content_length != length) return -1;
+        parser->content_length = length;
+    } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+        // Only chunked as the final coding is something we can frame
+        size_t vlen = value_end - value;
+        if (vlen < 7 || strncasecmp(value_end - 7, "chunked", 7) != 0) return -1;
+        parser->chunked = 1;
     }
-    
-    if (path_str) {
-        // Check for query string
-        char *query_start = strchr(path_str, '?');
-        if (query_start) {
-            *query_start = '\0';
-            query_start++;
-            request->query_string = malloc(strlen(query_start) + 1);
-            strcpy(request->query_string, query_start);
+
+    if (parser->header_count >= MAX_HEADERS) return 0;
+
+    lw_header_view_t *hdr = &parser->headers[parser->header_count++];
+    hdr->name.off = start;
+    hdr->name.len = name_len;
+    hdr->value.off = value - buf;
+    hdr->value.len = value_end - value;
+    return 0;
+}
+
+/* Parses as many complete lines of buf[0..len) as are available.
+ * Returns 1 once the head is complete, 0 when more bytes are needed,
+ * -1 on a malformed request. Never copies or allocates. */
+int lw_parser_execute(lw_parser_t *parser, const char *buf, size_t len) {
+    while (parser->state != LW_PARSE_DONE) {
+        size_t from = parser->scan > parser->pos ? parser->scan : parser->pos;
+        const char *nl = from < len ? memchr(buf + from, '\n', len - from) : NULL;
+        if (!nl) {
+            parser->scan = len;
+            return 0;
+        }
+
+        size_t start = parser->pos;
+        size_t next = nl - buf + 1;
+        size_t end = nl - buf;
+        if (end > start && buf[end - 1] == '\r') end--;
+        parser->pos = parser->scan = next;
+
+        if (parser->state == LW_PARSE_REQUEST_LINE) {
+            if (end == start) continue;     // tolerate leading blank lines
+            if (parse_request_line(parser, buf, start, end) < 0) return -1;
+            parser->state = LW_PARSE_HEADERS;
+        } else if (end == start) {
+            // Both framings at once is how requests get smuggled
+            if (parser->chunked && parser->content_length >= 0) return -1;
+            parser->head_len = next;
+            parser->state = LW_PARSE_DONE;
+        } else if (parse_header_line(parser, buf, start, end) < 0) {
+            return -1;
         }
-        
-        request->path = malloc(strlen(path_str) + 1);
-        strcpy(request->path, path_str);
     }
-    
-    // Move to next line
-    current = line_end + 2; // Skip \r\n
-    
-    // Parse headers
-    request->header_count = 0;
-    while (*current && request->header_count < MAX_HEADERS) {
-        line_end = strstr(current, "\r\n");
-        if (!line_end) break;
-        
-        line_len = line_end - current;
-        
-        // Empty line indicates end of headers
-        if (line_len == 0) {
-            current = line_end + 2; // Skip \r\n
+    return 1;
+}
+
+/* Fills `request` with views into buf, NUL-terminating each field in place.
+ * The head must have been parsed completely; the body is not terminated. */
+void lw_request_from_parser(const lw_parser_t *parser, char *buf, http_request_t *request) {
+    memset(request, 0, sizeof(*request));
+    request->method = parser->method;
+    request->version_minor = parser->version_minor;
+
+    request->path = buf + parser->path.off;
+    if (parser->query.off) {
+        request->query_string = buf + parser->query.off;
+        request->query_string[parser->query.len] = '\0';
+    }
+    request->path[parser->path.len] = '\0';
+
+    // Each header stays "Name: value", cut right after the trimmed value
+    for (int i = 0; i < parser->header_count; i++) {
+        const lw_header_view_t *hdr = &parser->headers[i];
+        request->headers[i] = buf + hdr->name.off;
+        buf[hdr->value.off + hdr->value.len] = '\0';
+    }
+    request->header_count = parser->header_count;
+
+    if (parser->content_length > 0) {
+        request->body = buf + parser->head_len;
+        request->body_length = parser->content_length;
+    }
+}
+
+void lw_body_init(lw_body_decoder_t *body, const lw_parser_t *parser) {
+    memset(body, 0, sizeof(*body));
+    if (parser->chunked) {
+        body->framing = LW_BODY_CHUNKED;
+        body->state = LW_CHUNK_SIZE;
+    } else if (parser->content_length > 0) {
+        body->framing = LW_BODY_LENGTH;
+        body->remaining = parser->content_length;
+        body->state = LW_CHUNK_DATA;
+    } else {
+        body->framing = LW_BODY_NONE;
+        body->state = LW_CHUNK_DONE;
+    }
+}
+
+#define LW_CHUNK_LINE_MAX 1024
+
+/* Consumes framing from buf[0..len) until it can hand out one data piece,
+ * needs more bytes, or the body is complete (state LW_CHUNK_DONE).
+ * Returns the bytes consumed, -1 on malformed framing. *piece points into
+ * buf and lies within the consumed range; *piece_len is 0 if none. */
+long lw_body_next(lw_body_decoder_t *body, const char *buf, size_t len,
+                  const char **piece, size_t *piece_len) {
+    size_t pos = 0;
+    *piece = NULL;
+    *piece_len = 0;
+
+    while (body->state != LW_CHUNK_DONE) {
+        if (body->state == LW_CHUNK_DATA) {
+            size_t n = len - pos < body->remaining ? len - pos : body->remaining;
+            if (n == 0) break;
+            *piece = buf + pos;
+            *piece_len = n;
+            pos += n;
+            body->remaining -= n;
+            body->received += n;
+            if (body->remaining == 0)
+                body->state = body->framing == LW_BODY_CHUNKED ? LW_CHUNK_DATA_END : LW_CHUNK_DONE;
+            break;
+        }
+
+        // Everything else in chunked framing is line based
+        const char *nl = memchr(buf + pos, '\n', len - pos);
+        if (!nl) {
+            if (len - pos > LW_CHUNK_LINE_MAX) return -1;
             break;
         }
-        
-        // Copy header line
-        if (line_len >= sizeof(line_buffer)) line_len = sizeof(line_buffer) - 1;
-        strncpy(line_buffer, current, line_len);
-        line_buffer[line_len] = '\0';
-        
-        // Check if it's a valid header (contains colon)
-        if (strchr(line_buffer, ':')) {
-            request->headers[request->header_count] = malloc(strlen(line_buffer) + 1);
-            strcpy(request->headers[request->header_count], line_buffer);
-            request->header_count++;
+        const char *line = buf + pos;
+        size_t line_len = nl - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        pos = nl - buf + 1;
+
+        if (body->state == LW_CHUNK_SIZE) {
+            size_t size = 0;
+            size_t i = 0;
+            for (; i < line_len; i++) {
+                char c = line[i];
+                int digit = (c >= '0' && c <= '9') ? c - '0' :
+                            (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                            (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+                if (digit < 0) break;
+                if (size > (SIZE_MAX >> 4)) return -1;
+                size = (size << 4) | digit;
+            }
+            // At least one hex digit, then optional chunk extensions
+            if (i == 0 || (i < line_len && line[i] != ';' && line[i] != ' ' && line[i] != '\t'))
+                return -1;
+            body->remaining = size;
+            body->state = size ? LW_CHUNK_DATA : LW_CHUNK_TRAILER;
+        } else if (body->state == LW_CHUNK_DATA_END) {
+            if (line_len != 0) return -1;
+            body->state = LW_CHUNK_SIZE;
+        } else if (line_len == 0) {
+            body->state = LW_CHUNK_DONE;    // trailers are skipped
         }
-        
-        // Move to next line
-        current = line_end + 2; // Skip \r\n
     }
-    
-    // Parse body (if any)
-    if (*current) {
-        size_t body_len = strlen(current);
-        if (body_len > 0) {
-            request->body_length = body_len;
-            request->body = malloc(body_len + 1);
-            strcpy(request->body, current);
+
+    return (long)pos;
+}
+
+// Copying wrapper for callers that hold a complete request in a string
+void parse_request(const char *raw_request, http_request_t *request) {
+    memset(request, 0, sizeof(*request));
+
+    size_t len = strlen(raw_request);
+    char *raw = malloc(len + 1);
+    if (!raw) return;
+    memcpy(raw, raw_request, len + 1);
+
+    lw_parser_t parser;
+    lw_parser_reset(&parser);
+    if (lw_parser_execute(&parser, raw, len) != 1) {
+        free(raw);
+        return;
+    }
+
+    lw_request_from_parser(&parser, raw, request);
+    request->raw = raw;
+
+    if (parser.chunked) {
+        // Decode in place, the framing only ever shrinks
+        lw_body_decoder_t body;
+        lw_body_init(&body, &parser);
+        char *src = raw + parser.head_len;
+        char *dst = src;
+        size_t left = len - parser.head_len;
+        while (body.state != LW_CHUNK_DONE) {
+            const char *piece;
+            size_t piece_len;
+            long used = lw_body_next(&body, src, left, &piece, &piece_len);
+            if (used <= 0) break;
+            memmove(dst, piece, piece_len);
+            dst += piece_len;
+            src += used;
+            left -= used;
         }
+        request->body = raw + parser.head_len;
+        request->body_length = dst - request->body;
+        *dst = '\0';
+    } else if (parser.content_length < 0 && len > parser.head_len) {
+        // Without framing information the body is whatever follows the head
+        request->body = raw + parser.head_len;
+        request->body_length = len - parser.head_len;
+    } else if (request->body && parser.head_len + request->body_length > len) {
+        request->body_length = len - parser.head_len;
     }
 }
 
 void free_request(http_request_t *request) {
-    if (request->path) free(request->path);
-    if (request->query_string) free(request->query_string);
-    if (request->body) free(request->body);
-    
+    free(request->raw);
+    request->raw = NULL;
+}
+
+// Returns the value of the first header called `name`, or NULL
+const char *lw_get_header(const http_request_t *request, const char *name) {
+    size_t name_len = strlen(name);
+
     for (int i = 0; i < request->header_count; i++) {
-        if (request->headers[i]) free(request->headers[i]);
+        const char *hdr = request->headers[i];
+        if (hdr && strncasecmp(hdr, name, name_len) == 0 && hdr[name_len] == ':') {
+            const char *value = hdr + name_len + 1;
+            while (*value == ' ' || *value == '\t') ++value;
+            return value;
+        }
     }
+    return NULL;
+}
+
+// Returns the value of the response header called `name`, or NULL
+const char *lw_get_response_header(const http_response_t *response, const char *name) {
+    size_t name_len = strlen(name);
+
+    for (int i = 0; i < response->header_count; i++) {
+        const char *hdr = response->headers[i];
+        if (hdr && strncasecmp(hdr, name, name_len) == 0 && hdr[name_len] == ':') {
+            const char *value = hdr + name_len + 1;
+            while (*value == ' ' || *value == '\t') ++value;
+            return value;
+        }
+    }
+    return NULL;
 }
 
 void init_response(http_response_t *response) {
@@ -110,12 +339,29 @@ void init_response(http_response_t *response) {
     response->header_count = 0;
     response->body = NULL;
     response->body_length = 0;
+    response->body_fd = -1;
+    response->body_offset = 0;
+    response->body_cached = NULL;
+    response->encoding = LW_ENC_IDENTITY;
+    response->vary = 0;
+    response->transfer_chunked = 0;
+    response->stream = 0;
+    response->arena = NULL;
 }
 
+/* With an arena the headers and body go away when it is reset, only the
+ * cache reference and the file need letting go of here. */
 void free_response(http_response_t *response) {
-    if (response->body) free(response->body);
-    
-    for (int i = 0; i < response->header_count; i++) {
+    int owned = !response->arena;
+
+    if (response->body_cached) lw_cache_release(response->body_cached);
+    else if (response->body && owned) free(response->body);
+    response->body_cached = NULL;
+    response->body = NULL;
+    if (response->body_fd >= 0) close(response->body_fd);
+    response->body_fd = -1;
+
+    for (int i = 0; owned && i < response->header_count; i++) {
         if (response->headers[i]) free(response->headers[i]);
     }
 }
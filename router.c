@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "run.h"
+
+/* Routes live in one compressed radix tree per method. Static labels are
+ * shared between paths, ":name" matches a single path segment and a path
+ * ending in '/' is a mount that serves everything below it. Lookup walks
+ * the path once; static edges win over parameters, and the longest mount
+ * is the fallback, so "/" only gets what nothing else claims. */
+typedef struct lw_route_node {
+    char   *label;                      /* static bytes consumed by this node */
+    size_t  label_len;
+    struct lw_route_node **children;    /* static edges, distinct first bytes */
+    int     child_count;
+    struct lw_route_node *param;        /* ":name" edge, one path segment */
+    route_t *exact;                     /* path ends here */
+    route_t *mount;                     /* path ends here and below */
+} lw_route_node_t;
+
+/* A captured segment, still a view into the path being matched. */
+typedef struct {
+    const char *start;
+    size_t len;
+} lw_capture_t;
+
+typedef struct {
+    lw_capture_t captures[LW_MAX_PARAMS];
+    int count;
+    route_t *mount;                     /* longest mount seen so far */
+    size_t mount_depth;
+    lw_capture_t mount_captures[LW_MAX_PARAMS];
+    int mount_count;
+} lw_match_t;
+
+// Every route by id, for code that reports on all of them
+static route_t **route_list;
+
+static lw_route_node_t *node_new(const char *label, size_t len) {
+    lw_route_node_t *node = calloc(1, sizeof(*node));
+    if (!node) return NULL;
+
+    node->label = malloc(len + 1);
+    if (!node->label) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->label_len = len;
+    return node;
+}
+
+static lw_route_node_t *node_child(lw_route_node_t *node, char first) {
+    for (int i = 0; i < node->child_count; i++)
+        if (node->children[i]->label[0] == first) return node->children[i];
+    return NULL;
+}
+
+static int node_add_child(lw_route_node_t *node, lw_route_node_t *child) {
+    lw_route_node_t **children = realloc(node->children, (node->child_count + 1) * sizeof(*children));
+    if (!children) return -1;
+    children[node->child_count++] = child;
+    node->children = children;
+    return 0;
+}
+
+/* Cuts child's label after `at` bytes; the head takes child's place. */
+static lw_route_node_t *node_split(lw_route_node_t *parent, lw_route_node_t *child, size_t at) {
+    lw_route_node_t *head = node_new(child->label, at);
+    if (!head) return NULL;
+
+    char *rest = strdup(child->label + at);
+    if (!rest || node_add_child(head, child) < 0) {
+        free(rest);
+        free(head->label);
+        free(head);
+        return NULL;
+    }
+    free(child->label);
+    child->label = rest;
+    child->label_len -= at;
+
+    for (int i = 0; i < parent->child_count; i++)
+        if (parent->children[i] == child) parent->children[i] = head;
+    return head;
+}
+
+/* Walks or grows the tree along path and returns the node it ends on.
+ * Parameter names are recorded on the route, not in the tree. */
+static lw_route_node_t *tree_insert(lw_route_node_t *node, const char *path, route_t *route) {
+    const char *p = path;
+
+    while (*p) {
+        if (*p == ':') {
+            const char *end = strchr(p, '/');
+            if (!end) end = p + strlen(p);
+            if (end == p + 1 || route->param_count == LW_MAX_PARAMS) return NULL;
+
+            route->param_names[route->param_count] = strndup(p + 1, end - p - 1);
+            if (!route->param_names[route->param_count]) return NULL;
+            route->param_count++;
+
+            if (!node->param && !(node->param = node_new("", 0))) return NULL;
+            node = node->param;
+            p = end;
+            continue;
+        }
+
+        size_t run = strcspn(p, ":");
+        lw_route_node_t *child = node_child(node, *p);
+        if (!child) {
+            child = node_new(p, run);
+            if (!child || node_add_child(node, child) < 0) return NULL;
+            node = child;
+            p += run;
+            continue;
+        }
+
+        size_t common = 0;
+        while (common < run && common < child->label_len && child->label[common] == p[common])
+            common++;
+        if (common < child->label_len && !(child = node_split(node, child, common)))
+            return NULL;
+        node = child;
+        p += common;
+    }
+    return node;
+}
+
+static route_t *tree_match(lw_route_node_t *node, const char *path, const char *p, lw_match_t *m) {
+    if (node->mount && (size_t)(p - path) >= m->mount_depth) {
+        m->mount = node->mount;
+        m->mount_depth = p - path;
+        memcpy(m->mount_captures, m->captures, m->count * sizeof(*m->captures));
+        m->mount_count = m->count;
+    }
+    if (*p == '\0') return node->exact;
+
+    lw_route_node_t *child = node_child(node, *p);
+    if (child && strncmp(p, child->label, child->label_len) == 0) {
+        route_t *route = tree_match(child, path, p + child->label_len, m);
+        if (route) return route;
+    }
+
+    if (node->param && *p != '/' && m->count < LW_MAX_PARAMS) {
+        size_t len = strcspn(p, "/");
+        m->captures[m->count].start = p;
+        m->captures[m->count].len = len;
+        m->count++;
+        route_t *route = tree_match(node->param, path, p + len, m);
+        if (route) return route;
+        m->count--;
+    }
+    return NULL;
+}
+
+void lw_route(http_method_t method, const char *path, route_handler_t handler) {
+    lw_route_stream(method, path, handler, NULL);
+}
+
+/* on_body receives the request body piece by piece as it arrives, then
+ * handler runs once it is complete. The body is never buffered whole. */
+void lw_route_stream(http_method_t method, const char *path, route_handler_t handler, body_handler_t on_body) {
+    if ((unsigned)method >= UNKNOWN || path[0] != '/') {
+        fprintf(stderr, "[ERR] Invalid route: %s %s\n", method_to_string(method), path);
+        return;
+    }
+
+    lw_route_node_t **root = &lw_ctx.routes[method];
+    if (!*root && !(*root = node_new("", 0))) {
+        fprintf(stderr, "[ERR] Out of memory registering %s\n", path);
+        return;
+    }
+
+    route_t *route = calloc(1, sizeof(*route));
+    lw_route_node_t *node = route ? tree_insert(*root, path, route) : NULL;
+    size_t len = strlen(path);
+    int mount = path[len - 1] == '/';
+    if (!node || !(route->path = strdup(path))) {
+        fprintf(stderr, "[ERR] Failed to register route %s\n", path);
+        goto fail;
+    }
+
+    // First registration wins, as it always has
+    route_t **slot = mount ? &node->mount : &node->exact;
+    if (*slot) {
+        fprintf(stderr, "[ERR] Route already registered: %s %s\n", method_to_string(method), path);
+        goto fail;
+    }
+
+    route_t **list = realloc(route_list, (lw_ctx.route_count + 1) * sizeof(*list));
+    if (!list) {
+        fprintf(stderr, "[ERR] Out of memory registering %s\n", path);
+        goto fail;
+    }
+    route_list = list;
+    route_list[lw_ctx.route_count] = route;
+    route->id = lw_ctx.route_count;
+
+    route->method = method;
+    route->handler = handler;
+    route->on_body = on_body;
+    *slot = route;
+    lw_ctx.route_count++;
+
+    LW_VERBOSE ? printf("[LW] Route registered: %s %s\n", method_to_string(method), path) : 0;
+    return;
+
+fail:
+    if (route) {
+        for (int i = 0; i < route->param_count; i++) free(route->param_names[i]);
+        free(route->path);
+        free(route);
+    }
+}
+
+/* Finds the route for path and, when params is given, copies the
+ * captured segments into it under the route's parameter names. */
+route_t *lw_match_route(http_method_t method, const char *path, lw_params_t *params) {
+    if (params) params->count = 0;
+    if ((unsigned)method >= UNKNOWN) return NULL;
+
+    // HEAD is answered by the GET route unless one was registered for HEAD
+    if (!lw_ctx.routes[method]) return method == HEAD ? lw_match_route(GET, path, params) : NULL;
+
+    lw_match_t m;
+    m.count = 0;
+    m.mount = NULL;
+    m.mount_depth = 0;
+    m.mount_count = 0;
+
+    lw_capture_t *captures = m.captures;
+    route_t *route = tree_match(lw_ctx.routes[method], path, path, &m);
+    if (!route && m.mount) {
+        route = m.mount;
+        captures = m.mount_captures;
+        m.count = m.mount_count;
+    }
+    if (!route && method == HEAD) return lw_match_route(GET, path, params);
+    if (!route || !params) return route;
+
+    size_t used = 0;
+    for (int i = 0; i < m.count && i < route->param_count; i++) {
+        size_t len = captures[i].len;
+        if (used + len + 1 > sizeof(params->buf)) break;
+
+        memcpy(params->buf + used, captures[i].start, len);
+        params->buf[used + len] = '\0';
+        params->items[i].name = route->param_names[i];
+        params->items[i].value = params->buf + used;
+        params->count++;
+        used += len + 1;
+    }
+    return route;
+}
+
+route_t *lw_route_at(int id) {
+    return id >= 0 && id < lw_ctx.route_count ? route_list[id] : NULL;
+}
+
+route_t *find_route(http_method_t method, const char *path) {
+    return lw_match_route(method, path, NULL);
+}
+
+// Returns the value captured for ":name" in the matched route, or NULL
+const char *lw_get_param(const http_request_t *request, const char *name) {
+    for (int i = 0; i < request->param_count; i++)
+        if (strcmp(request->params[i].name, name) == 0)
+            return request->params[i].value;
+    return NULL;
+}
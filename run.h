@@ -5,19 +5,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <zstd.h>
 
 #define MAX_HEADERS       50
-#define MAX_ROUTES        100
 #define BUFFER_SIZE       4096
 #define MAX_PATH_LENGTH   256
 #define MAX_WATCH_DESCRIPTORS 256
+#define LW_MAX_PARAMS     8
 
 // Global constants
 extern int LW_PORT;
@@ -28,9 +31,29 @@ extern int LW_CERT;
 extern int LW_KEY;
 extern int LW_SSL_ENABLED;
 extern int LW_COMPRESS;
+extern int LW_WORKERS;
+extern int LW_KEEPALIVE_TIMEOUT;
+extern int LW_KEEPALIVE_MAX;
+extern long LW_MAX_BODY_SIZE;
+extern long LW_CACHE_SIZE;
+extern long LW_TLS_SESSION_CACHE;
+extern int LW_TLS_TICKET_ROTATE;
+extern int LW_KTLS;
+extern int LW_TLS_HANDSHAKE_TIMEOUT;
+extern int LW_HANDSHAKE_WORKERS;
+extern int LW_HEADER_TIMEOUT;
+extern int LW_BODY_TIMEOUT;
+extern int LW_WRITE_TIMEOUT;
+extern int LW_MAX_PER_IP;
+extern const char* LW_EC_CERT_FILE;
+extern const char* LW_EC_KEY_FILE;
 extern const char* LW_CERT_FILE;
 extern const char* LW_KEY_FILE;
-extern const char *ACCEPT_ENCODING;
+extern const char* LW_METRICS_PATH;
+extern const char* LW_ACCESS_LOG;
+extern int LW_LOG_FORMAT;
+extern int LW_DRAIN_TIMEOUT;
+extern char **LW_ARGV;
 extern SSL *LW_SSL;
 extern SSL_CTX *ssl_ctx;
 
@@ -39,53 +62,412 @@ typedef enum {
     GET, POST, PUT, DELETE, PATCH, HEAD, OPTIONS, UNKNOWN
 } http_method_t;
 
+/* Bump allocator for memory that lives as long as one request; see arena.c */
+typedef struct lw_arena_block {
+    struct lw_arena_block *next;
+    size_t used;
+    size_t cap;
+    char   data[];
+} lw_arena_block_t;
+
+typedef struct {
+    lw_arena_block_t *block;    /* current block, older ones chained behind */
+    lw_arena_block_t *large;    /* one block per oversized allocation */
+} lw_arena_t;
+
+/* A ":name" segment captured by the router. */
+typedef struct {
+    const char *name;
+    const char *value;
+} lw_param_t;
+
+/* Captured values are copied out of the path so each is NUL-terminated. */
+typedef struct {
+    lw_param_t items[LW_MAX_PARAMS];
+    int  count;
+    char buf[MAX_PATH_LENGTH];
+} lw_params_t;
+
+/* Request fields are views: they point into the connection's read buffer
+ * (NUL-terminated in place) or into `raw` when parse_request made a copy. */
 typedef struct {
     http_method_t method;
+    int   version_minor;    /* 1 for HTTP/1.1, 0 for HTTP/1.0 and older */
     char *path;
     char *query_string;
     char *headers[MAX_HEADERS];
     int   header_count;
     char *body;
     size_t body_length;
+    const lw_param_t *params;   /* see lw_get_param */
+    int   param_count;
     void *user_data;
+    lw_arena_t *arena;      /* see lw_alloc, NULL outside the event loop */
+    struct lw_conn *conn;   /* for lw_wait_fd/lw_wait_timer, NULL outside the loop */
+    char *raw;              /* owned backing copy, NULL for zero-copy requests */
 } http_request_t;
 
+// Incremental parser
+typedef struct {
+    size_t off;
+    size_t len;
+} lw_span_t;
+
+typedef struct {
+    lw_span_t name;
+    lw_span_t value;
+} lw_header_view_t;
+
+typedef enum {
+    LW_PARSE_REQUEST_LINE, LW_PARSE_HEADERS, LW_PARSE_DONE
+} lw_parse_state_t;
+
+/* Resumable over a growing buffer: call lw_parser_execute again with the
+ * same buffer after more bytes arrive. All spans are offsets into it. */
+typedef struct {
+    lw_parse_state_t state;
+    size_t pos;             /* start of the next unparsed line */
+    size_t scan;            /* bytes already searched for the line end */
+    http_method_t method;
+    int    version_minor;
+    lw_span_t method_str;
+    lw_span_t path;
+    lw_span_t query;
+    lw_header_view_t headers[MAX_HEADERS];
+    int    header_count;
+    size_t head_len;        /* request line + headers + blank line */
+    long   content_length;  /* -1 when absent */
+    int    chunked;         /* Transfer-Encoding: chunked */
+} lw_parser_t;
+
+typedef enum {
+    LW_BODY_NONE, LW_BODY_LENGTH, LW_BODY_CHUNKED
+} lw_body_framing_t;
+
+typedef enum {
+    LW_CHUNK_SIZE, LW_CHUNK_DATA, LW_CHUNK_DATA_END, LW_CHUNK_TRAILER, LW_CHUNK_DONE
+} lw_chunk_state_t;
+
+/* Strips Content-Length or chunked framing off a request body, one data
+ * piece at a time, without copying. */
+typedef struct {
+    lw_body_framing_t framing;
+    lw_chunk_state_t  state;
+    size_t remaining;       /* bytes left in the body or current chunk */
+    size_t received;        /* decoded body bytes so far */
+} lw_body_decoder_t;
+
+/* Content codings, in order of preference when a client weighs them equally. */
+typedef enum {
+    LW_ENC_IDENTITY, LW_ENC_ZSTD, LW_ENC_BROTLI, LW_ENC_GZIP, LW_ENC_COUNT
+} lw_encoding_t;
+
+typedef enum {
+    LW_FLUSH_NONE,  /* buffer freely */
+    LW_FLUSH_SYNC,  /* everything written so far can be decoded */
+    LW_FLUSH_END    /* finish the stream */
+} lw_flush_t;
+
+/* Streaming encoder for one body; see compress.c */
+typedef struct lw_compressor lw_compressor_t;
+
+typedef struct {
+    char  *data;
+    size_t size;
+    int    built;           /* tried already, data stays NULL if not worth it */
+    int    queued;          /* handed to the background builder */
+} lw_variant_t;
+
+/* A file held in memory by the static asset cache. Shared between
+ * workers and responses; freed when the last reference is released. */
+typedef struct lw_cache_entry {
+    char   *path;
+    char   *data;           /* NUL-terminated copy of the file */
+    size_t  size;
+    const char *mime;
+    time_t  mtime;
+    ino_t   ino;
+    int     refs;
+    int     cached;         /* still owned by the table */
+    lw_variant_t variants[LW_ENC_COUNT];    /* compressed once, in the background */
+    struct lw_cache_entry *hnext;       /* hash bucket chain */
+    struct lw_cache_entry *prev, *next; /* LRU list */
+} lw_cache_entry_t;
+
 typedef struct {
     int   status_code;
     char *headers[MAX_HEADERS];
     int   header_count;
     char *body;
     size_t body_length;
-    int   chunked_fd;   /* >=0 -> chunked stream */
+    int   body_fd;      /* >=0 -> body_length bytes sent from this file, owned */
+    off_t body_offset;
+    lw_cache_entry_t *body_cached;  /* set: body borrows this entry's data */
+    lw_encoding_t encoding;         /* body is already compressed with this */
+    int   vary;                     /* picked by Accept-Encoding, even if sent as identity */
+    int   transfer_chunked;         /* body follows in chunked framing, no Content-Length */
+    int   stream;                   /* body comes from lw_stream_write, after the head */
+    int   head_only;                /* HEAD: framing as for GET, no body */
+    lw_arena_t *arena;              /* set: headers and body are allocated here */
 } http_response_t;
 
 typedef void (*route_handler_t)(http_request_t *, http_response_t *);
 
+/* Ready mask passed to a resumed handler */
+#define LW_WAIT_READ  1
+#define LW_WAIT_WRITE 2
+#define LW_WAIT_ERROR 4
+#define LW_WAIT_TIMER 8
+
+/* Continues a handler that suspended itself. It may wait again; once it
+ * returns without doing so, the response is sent as usual. */
+typedef void (*lw_resume_t)(http_request_t *req, http_response_t *res, int events, void *arg);
+typedef void (*body_handler_t)(http_request_t *, const char *data, size_t len);
+
 typedef struct {
     http_method_t method;
-    char path[MAX_PATH_LENGTH];
+    char *path;
     route_handler_t handler;
+    body_handler_t  on_body;    /* set: body is streamed here, not buffered */
+    char *param_names[LW_MAX_PARAMS];   /* ":name" segments, in path order */
+    int   param_count;
+    int   id;                   /* registration order, indexes per-route metrics */
 } route_t;
 
+/* Radix tree node; see router.c */
+struct lw_route_node;
+
 typedef struct {
-    route_t routes[MAX_ROUTES];
+    struct lw_route_node *routes[UNKNOWN];  /* one tree per method */
     int route_count;
     int server_fd;
     int port;
 } lw_context_t;
 
-// Shared chunked-state
-typedef struct {
-    int chunked_fds[64];
-    int chunked_count;
-    pthread_mutex_t chunked_mutex;
-} chunked_state_t;
-
 typedef struct {
     int wd;
     char path[256];
 } watch_descriptor_t;
 
+// Event loop
+typedef struct {
+    char  *data;
+    size_t len;
+    size_t cap;
+} lw_buf_t;
+
+/* A body written straight from where it lives instead of being copied
+ * into `out`. It is kept alive by `owned` or `entry` until it is sent;
+ * with neither set it lives in the response's arena. */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t at;                  /* goes out after this many bytes of `out` */
+    char  *owned;               /* free()d once sent */
+    lw_cache_entry_t *entry;    /* released once sent */
+} lw_seg_t;
+
+typedef enum {
+    LW_EV_LISTENER, LW_EV_BROADCAST, LW_EV_CONN, LW_EV_HANDSHAKE, LW_EV_WAIT, LW_EV_WAKE
+} lw_ev_kind_t;
+
+/* Everything registered with epoll starts with one of these, so the
+ * event's data.ptr can be dispatched on kind. */
+typedef struct {
+    lw_ev_kind_t kind;
+    int fd;
+} lw_ev_source_t;
+
+typedef enum {
+    LW_CONN_HANDSHAKE,  /* TLS handshake in progress */
+    LW_CONN_READING,    /* waiting for a complete request head */
+    LW_CONN_DISPATCH,   /* request buffered, handler not run yet */
+    LW_CONN_SUSPENDED,  /* handler waits on an fd or timer */
+    LW_CONN_STREAMING,  /* head sent, body comes from lw_stream_write */
+    LW_CONN_WRITING,    /* flushing the serialized response */
+    LW_CONN_CLOSING
+} lw_conn_state_t;
+
+/* Timer wheel, ticking once a second; see timer.c */
+#define LW_WHEEL_BITS   6
+#define LW_WHEEL_SIZE   (1 << LW_WHEEL_BITS)
+#define LW_WHEEL_LEVELS 4       /* 64^4 ticks, about six months */
+
+typedef struct lw_timer {
+    struct lw_timer *next;
+    struct lw_timer **pprev;    /* NULL while not armed */
+    uint64_t expires;           /* tick */
+} lw_timer_t;
+
+typedef struct {
+    uint64_t now;               /* last tick moved through */
+    size_t count;               /* armed timers */
+    lw_timer_t *slots[LW_WHEEL_LEVELS][LW_WHEEL_SIZE];
+    lw_timer_t *due;
+} lw_wheel_t;
+
+/* What a connection's timer is running for. Fixed ones count from when
+ * the phase began, the others from the last byte that moved. */
+typedef enum {
+    LW_TIMEOUT_NONE,
+    LW_TIMEOUT_HANDSHAKE,   /* fixed */
+    LW_TIMEOUT_HEADER,      /* fixed, so a head dripped in byte by byte still ends */
+    LW_TIMEOUT_IDLE,        /* fixed, keep-alive between requests */
+    LW_TIMEOUT_BODY,
+    LW_TIMEOUT_WRITE,
+    LW_TIMEOUT_KINDS
+} lw_timeout_t;
+
+extern const char *const lw_timeout_names[LW_TIMEOUT_KINDS];   /* for logs and metrics */
+
+/* The fd or timer a suspended handler waits on. */
+typedef struct {
+    lw_ev_source_t src;     /* kind LW_EV_WAIT */
+    lw_resume_t resume;     /* set while suspended */
+    void  *arg;
+    int    timer;           /* src.fd is our timerfd */
+} lw_wait_t;
+
+/* A response body produced piece by piece; see lw_stream_begin. */
+typedef struct {
+    lw_resume_t produce;    /* set once the handler started a stream */
+    void  *arg;
+    int    chunked;         /* frame writes; HTTP/1.0 peers read until close */
+    int    ended;
+    int    closed;          /* peer is gone, writes fail */
+    lw_compressor_t *zc;    /* set: writes are compressed on the way out */
+    int    held;            /* zc has writes not flushed to `out` yet */
+} lw_stream_t;
+
+typedef struct lw_conn {
+    lw_ev_source_t  src;    /* must stay first */
+    lw_conn_state_t state;
+    SSL     *ssl;
+    int      ktls;          /* kernel encrypts writes, SSL_sendfile works */
+    lw_buf_t in;
+    lw_buf_t out;
+    size_t   out_off;
+    lw_seg_t *segs;         /* large bodies interleaved with `out` */
+    int      seg_count;
+    int      seg_cap;
+    int      seg_pos;       /* first segment not fully sent */
+    size_t   seg_sent;      /* bytes of segs[seg_pos] already sent */
+    size_t   seg_bytes;     /* queued in segs, for the pipelining cap */
+    int      file_fd;       /* fd-backed body queued behind `out`, -1 if none */
+    off_t    file_off;
+    size_t   file_left;
+    lw_compressor_t *file_zc;   /* set: file is sent compressed, in chunks */
+    lw_parser_t parser;     /* resumes across reads of `in` */
+    lw_body_decoder_t body;
+    size_t   body_end;      /* end of the decoded body bytes kept in `in` */
+    size_t   raw_pos;       /* start of the not yet decoded bytes in `in` */
+    route_t *route;
+    lw_params_t params;     /* captured by the router for `route` */
+    lw_arena_t arena;       /* reset once everything queued is sent */
+    http_request_t request; /* views into `in`, rebuilt after it moves */
+    int      requests;      /* served on this connection so far */
+    int      status;        /* of the response being sent, for metrics and the log */
+    uint64_t resp_bytes;    /* of that response, for the access log */
+    uint64_t started_ns;    /* accept for handshakes, then each request's head */
+    int      keep_alive;    /* decided for the request being handled */
+    char     body_saved;    /* byte under the body's NUL terminator */
+    lw_wait_t wait;
+    http_response_t pending;    /* response of a handler that is not done */
+    lw_stream_t stream;
+    int      close_after;   /* close once out is flushed */
+    int      dead;          /* closed, freed after the current batch of events */
+    int      eof;           /* peer finished sending */
+    int      hs_offloaded;  /* a pool thread owns the SSL right now */
+    int      hs_pending;    /* events arrived while offloaded */
+    int      hs_rc;         /* result of the offloaded SSL_accept step */
+    struct lw_conn *hs_next;
+    struct lw_loop *loop;
+    lw_timer_t timer;       /* one per connection, re-armed per phase */
+    lw_timeout_t timeout;   /* what timer runs for */
+    int      progress;      /* bytes moved since the timer was last looked at */
+    struct lw_conn *prev, *next;
+    struct in_addr addr;    /* peer, formatted only by the log writer */
+} lw_conn_t;
+
+/* Latency histogram in microseconds; see metrics.c */
+#define LW_HIST_SUB     8       /* buckets per power of two */
+#define LW_HIST_BUCKETS (LW_HIST_SUB * 30)
+#define LW_METRICS_STATUS 600
+
+typedef struct {
+    uint64_t buckets[LW_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+} lw_hist_t;
+
+/* One worker's counters. Only its loop writes them. */
+typedef struct lw_metrics {
+    uint64_t bytes_in, bytes_out;
+    uint64_t parse_errors;
+    uint64_t compress_in, compress_out, compress_ns;
+    uint64_t status[LW_METRICS_STATUS];
+    uint64_t timeouts[LW_TIMEOUT_KINDS];
+    uint64_t per_ip_rejected;
+    lw_hist_t tls_handshake;
+    lw_hist_t *routes;          /* by route id, the last slot for 404s */
+    int route_slots;
+    struct lw_loop *loop;
+    struct lw_metrics *next;
+} lw_metrics_t;
+
+// Single writer, so no read-modify-write is needed; readers see whole values
+static inline void lw_metric_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* One access log line, copied into a worker's ring; see accesslog.c */
+typedef struct {
+    time_t   time;
+    struct in_addr addr;
+    uint32_t latency_us;
+    uint64_t bytes;
+    short    status;
+    unsigned char method;       /* UNKNOWN when the request line never parsed */
+    unsigned char version_minor;
+    char     path[232];         /* path?query, cut to fit */
+} lw_log_record_t;
+
+typedef struct lw_log_ring lw_log_ring_t;
+
+typedef struct lw_loop {
+    int id;             /* worker index */
+    int epoll_fd;
+    lw_ev_source_t listener;
+    lw_ev_source_t hs_wake;     /* eventfd, the handshake pool finished a step */
+    pthread_mutex_t hs_mutex;
+    lw_conn_t *hs_done;         /* handed back by the pool, via hs_next */
+    lw_conn_t *graveyard;       /* closed during this batch, via next */
+    lw_ev_source_t sse_wake;    /* eventfd, lw_broadcast queued events */
+    pthread_mutex_t sse_mutex;
+    struct lw_sse_item *sse_inbox, *sse_tail;
+    struct lw_sse_sub *sse_subs;    /* event streams on this loop; see sse.c */
+    int sse_count;
+    time_t sse_last_ping;
+    struct lw_loop *sse_next;
+    lw_metrics_t *metrics;
+    lw_log_ring_t *log;         /* NULL when the access log is off */
+    lw_ev_source_t wake;        /* eventfd, lw_loop_drain was called */
+    time_t drain_at;            /* set from another thread: stop by then */
+    int draining;               /* no longer accepting or keeping alive */
+    int conn_count;
+    lw_conn_t *conns;   /* every open connection */
+    time_t now;         /* refreshed after every epoll_wait */
+    uint64_t tick;      /* monotonic seconds, the wheel's clock */
+    lw_wheel_t timers;  /* connection timeouts */
+} lw_loop_t;
+
+/* One per thread: its own SO_REUSEPORT listener and event loop. */
+typedef struct {
+    pthread_t thread;
+    int listen_fd;
+    lw_loop_t loop;
+} lw_worker_t;
+
 typedef struct {
     watch_descriptor_t watch_descriptors[MAX_WATCH_DESCRIPTORS];
     int watch_count;
@@ -93,11 +475,9 @@ typedef struct {
     int inotify_fd;
     volatile int shutdown_requested;
     volatile int reload_needed;
-    int reload_pipe[2];
     time_t last_change_time;
 } HotReloadState;
 
-extern chunked_state_t chunked_state;
 extern HotReloadState hot_reload_state;
 
 // Global context
@@ -106,37 +486,157 @@ extern lw_context_t lw_ctx;
 // Functions
 int  lw_run(int port);
 void lw_route(http_method_t method, const char *path, route_handler_t handler);
+void lw_route_stream(http_method_t method, const char *path, route_handler_t handler, body_handler_t on_body);
 void lw_send_response(http_response_t *response, int client_socket, SSL *client_ssl, const char *accept_encoding);
 void lw_set_header(http_response_t *response, const char *header);
 void lw_set_body(http_response_t *response, const char *body);
 void lw_set_body_bin(http_response_t *response, const char *body, size_t length);
+void lw_set_body_fd(http_response_t *response, int fd, off_t offset, size_t length);
+void lw_set_body_cached(http_response_t *response, lw_cache_entry_t *entry);
+int  lw_serialize_response(http_response_t *response, const char *accept_encoding, lw_buf_t *out);
+int  lw_serialize_head(http_response_t *response, const char *accept_encoding, lw_buf_t *out, lw_seg_t *body);
+void lw_seg_release(lw_seg_t *seg);
+const char *lw_status_line(int status, size_t *len);
+
+int  lw_loop_init(lw_loop_t *loop, int id, int listen_fd);
+int  lw_wait_fd(http_request_t *request, int fd, int events, lw_resume_t resume, void *arg);
+int  lw_wait_timer(http_request_t *request, long ms, lw_resume_t resume, void *arg);
+int  lw_stream_begin(http_request_t *request, http_response_t *response, lw_resume_t produce, void *arg);
+int  lw_stream_write(http_request_t *request, const void *data, size_t len);
+int  lw_stream_end(http_request_t *request);
+void lw_stream_wake(http_request_t *request);
+
+// Server-Sent Events
+#define LW_RELOAD_CHANNEL "reload"
+#define LW_RELOAD_PATH    "/__lw/reload"
+int  lw_sse_subscribe(http_request_t *request, http_response_t *response, const char *channel);
+int  lw_broadcast(const char *channel, const char *data);
+void lw_sse_use_reload(void);
+int  lw_sse_loop_init(lw_loop_t *loop);
+void lw_sse_loop_close(lw_loop_t *loop);
+void lw_sse_deliver(lw_loop_t *loop);
+void lw_sse_tick(lw_loop_t *loop);
+void lw_sse_drain(lw_loop_t *loop);
+
+// Metrics
+uint64_t lw_now_ns(void);
+void lw_hist_record(lw_hist_t *hist, uint64_t us);
+int  lw_metrics_loop_init(lw_loop_t *loop);
+void lw_metrics_loop_close(lw_loop_t *loop);
+void lw_metrics_bind(lw_metrics_t *metrics);
+void lw_metrics_request(lw_metrics_t *metrics, const route_t *route, int status, uint64_t ns);
+void lw_metrics_compress(size_t in, size_t out, uint64_t ns);
+int  lw_metrics_render(lw_buf_t *out);
+void lw_metrics_use(const char *path);
+route_t *lw_route_at(int id);
+
+// Access log
+#define LW_LOG_COMMON 0
+#define LW_LOG_JSON   1
+int  lw_access_log_start(void);
+void lw_access_log_stop(void);
+int  lw_log_loop_init(lw_loop_t *loop);
+lw_log_record_t *lw_log_reserve(lw_log_ring_t *ring);
+void lw_log_commit(lw_log_ring_t *ring);
+
+// Timer wheel
+void lw_wheel_init(lw_wheel_t *w, uint64_t now);
+void lw_timer_arm(lw_wheel_t *w, lw_timer_t *t, uint64_t expires);
+void lw_timer_cancel(lw_wheel_t *w, lw_timer_t *t);
+lw_timer_t *lw_wheel_next(lw_wheel_t *w, uint64_t now);
+
+// Concurrent connections per client address, across every worker
+int  lw_ip_acquire(struct in_addr addr);
+void lw_ip_release(struct in_addr addr);
+
+// Graceful restart and binary upgrade
+void lw_block_signals(void);
+int  lw_upgrade_inherit(int port, int *fds, int max);
+void lw_upgrade_ready(void);
+int  lw_upgrade_spawn(const int *listen_fds, int count);
+int  lw_handshake_pool_start(int threads);
+void lw_handshake_pool_stop(void);
+int  lw_handshake_pool_enabled(void);
+int  lw_handshake_loop_init(lw_loop_t *loop);
+void lw_handshake_submit(lw_conn_t *conn);
+lw_conn_t *lw_handshake_collect(lw_loop_t *loop);
+int  lw_loop_run(lw_loop_t *loop);
+void lw_loop_drain(lw_loop_t *loop, time_t deadline);
+void lw_loop_close(lw_loop_t *loop);
+
+void *lw_arena_alloc(lw_arena_t *arena, size_t n);
+char *lw_arena_strdup(lw_arena_t *arena, const char *s);
+void  lw_arena_reset(lw_arena_t *arena);
+void  lw_arena_free(lw_arena_t *arena);
+void *lw_alloc(http_request_t *request, size_t n);
+
+int  lw_buf_reserve(lw_buf_t *buf, size_t extra);
+int  lw_buf_append(lw_buf_t *buf, const void *data, size_t len);
+int  lw_buf_printf(lw_buf_t *buf, const char *fmt, ...);
+void lw_buf_free(lw_buf_t *buf);
 
 http_method_t parse_method(const char *method_str);
+http_method_t lw_method_from(const char *s, size_t len);
+void lw_parser_reset(lw_parser_t *parser);
+int  lw_parser_execute(lw_parser_t *parser, const char *buf, size_t len);
+void lw_request_from_parser(const lw_parser_t *parser, char *buf, http_request_t *request);
+void lw_body_init(lw_body_decoder_t *body, const lw_parser_t *parser);
+long lw_body_next(lw_body_decoder_t *body, const char *buf, size_t len,
+                  const char **piece, size_t *piece_len);
 void parse_request(const char *raw_request, http_request_t *request);
 void free_request(http_request_t *request);
+const char *lw_get_header(const http_request_t *request, const char *name);
+const char *lw_get_response_header(const http_response_t *response, const char *name);
 void init_response(http_response_t *response);
 void free_response(http_response_t *response);
 
 const char *method_to_string(http_method_t method);
 route_t *find_route(http_method_t method, const char *path);
+route_t *lw_match_route(http_method_t method, const char *path, lw_params_t *params);
+const char *lw_get_param(const http_request_t *request, const char *name);
 
 char *load_html_file(const char *filename);
 void  render_html(http_response_t *res, const char *filename);
 void  static_file_handler(http_request_t *req, http_response_t *res);
 void  use_static_files(void);
+const char *lw_mime_type(const char *path);
+int  lw_mime_register(const char *ext, const char *type);
+
+lw_cache_entry_t *lw_cache_get(const char *path);
+void lw_cache_release(lw_cache_entry_t *entry);
+int  lw_cache_encode(lw_cache_entry_t *entry, lw_encoding_t encoding);
+const char *lw_variant_suffix(lw_encoding_t encoding);
+
+lw_encoding_t lw_pick_encoding(const char *accept_encoding);
+int  lw_rank_encodings(const char *accept_encoding, lw_encoding_t order[LW_ENC_COUNT]);
+const char *lw_encoding_name(lw_encoding_t encoding);
+int  lw_compressible(const char *mime);
+int  lw_compress(lw_encoding_t encoding, int level, const void *src, size_t len, lw_buf_t *out);
+lw_compressor_t *lw_compressor_new(lw_encoding_t encoding);
+int  lw_compressor_write(lw_compressor_t *c, const void *src, size_t len,
+                         lw_flush_t flush, lw_buf_t *out);
+void lw_compressor_free(lw_compressor_t *c);
+void lw_cache_invalidate(const char *path, int recursive);
+void lw_cache_clear(void);
+void lw_cache_set_watched(int watched);
 
 int parameter_controller(int argc, char *argv[]);
 void print_help(void);
 
 void start_live_reload_server(int ws_port_unused, const char *watch_dir);
+int  start_file_watcher(const char *watch_dir);
 
 // SSL
 void init_openssl();
 void cleanup_openssl();
 SSL_CTX* create_ssl_ctx();
 void configure_ssl_ctx(SSL_CTX* ctx, const char* cert_file, const char* key_file);
-
-int get_reload_pipe_fd(void);
+void configure_ssl_sessions(SSL_CTX *ctx, int workers);
+void configure_ssl_ktls(SSL_CTX *ctx);
+int  lw_tls_accept(SSL *ssl);
+void lw_tls_handshake_done(SSL *ssl);
+int  lw_tls_ktls_send(SSL *ssl);
+void lw_tls_stats(unsigned long *full, unsigned long *resumed);
 
 void index_handler(http_request_t *req, http_response_t *res);
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "run.h"
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -8,24 +9,120 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
-#include <sys/time.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
 extern HotReloadState hot_reload_state;
 static int http_redirect_port = 8080;
+static int redirect_fd = -1;    /* handed over on upgrade with the workers' */
 
 void use_static_files();
 void start_redirector(void);
 
+static int create_listener(int port, int reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("[ERR] Socket creation failed");
+        return -1;
+    }
+
+    // Set socket options
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        perror("[ERR] Setsockopt failed");
+        close(fd);
+        return -1;
+    }
+
+    // Every worker binds its own socket and the kernel balances between them
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("[ERR] SO_REUSEPORT failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    // Bind socket
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("[ERR] Bind failed");
+        close(fd);
+        return -1;
+    }
+
+    // Listen for connections
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("[ERR] Listen failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void *worker_main(void *arg) {
+    lw_worker_t *worker = arg;
+    lw_loop_run(&worker->loop);
+    return NULL;
+}
+
+/* Waits for signals on the main thread while the workers serve. SIGUSR2
+ * hands the listeners to a new process and drains once it serves;
+ * SIGINT or SIGTERM drains, and a second one stops right away. */
+static void serve_signals(lw_worker_t *workers, int count) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+
+    int listen_fds[count + 1];
+    for (int i = 0; i < count; i++) listen_fds[i] = workers[i].listen_fd;
+    int handed = count;
+    if (redirect_fd >= 0) listen_fds[handed++] = redirect_fd;
+
+    for (;;) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        if (sig != SIGUSR2) {
+            printf("[LW] Shutting down, finishing open requests\n");
+            break;
+        }
+        printf("[LW] Upgrading\n");
+        if (lw_upgrade_spawn(listen_fds, handed) == 0) {
+            printf("[LW] New process is serving, finishing open requests\n");
+            break;
+        }
+    }
+
+    time_t deadline = time(NULL) + LW_DRAIN_TIMEOUT;
+    for (int i = 0; i < count; i++) lw_loop_drain(&workers[i].loop, deadline);
+
+    // Workers leave when their connections are done; poll so a second signal still counts
+    struct timespec tick = { 0, 100 * 1000000L };
+    for (int i = 0; i < count; ) {
+        if (pthread_tryjoin_np(workers[i].thread, NULL) == 0) {
+            i++;
+            continue;
+        }
+        int sig = sigtimedwait(&set, NULL, &tick);
+        if (sig == SIGINT || sig == SIGTERM) {
+            printf("[LW] Closing remaining connections\n");
+            for (int j = i; j < count; j++) lw_loop_drain(&workers[j].loop, time(NULL));
+        }
+    }
+}
+
 int lw_run(int port) {
-    if (LW_SSL_ENABLED == 1) start_redirector();
+    // Before any thread starts, so only serve_signals receives them
+    lw_block_signals();
 
-    struct sockaddr_in address;
-    int addr_len = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
+    if (LW_SSL_ENABLED == 1) start_redirector();
 
     lw_ctx.port = port;
 
@@ -46,227 +143,103 @@ int lw_run(int port) {
         printf("[LW] Server is listening on http://localhost:%d\n", port);
     }
 
-    // Create socket
-    if ((lw_ctx.server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("[ERR] Socket creation failed");
-        return -1;
-    }
+    // A client hanging up mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-    // Set socket options=
-    int opt = 1;
-    if (setsockopt(lw_ctx.server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("[ERR] Setsockopt failed");
-        close(lw_ctx.server_fd);
-        return -1;
-    }
+    // Keeps the static file cache exact instead of re-checking mtimes
+    if (LW_CACHE_SIZE > 0 && !LW_DEV_MODE) start_file_watcher("./public");
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    // Pages reload when the watcher sees a change
+    if (LW_DEV_MODE) lw_sse_use_reload();
 
-    // Bind socket
-    if (bind(lw_ctx.server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("[ERR] Bind failed");
-        close(lw_ctx.server_fd);
-        return -1;
+    // Registered before the loops so it gets its own metrics slot too
+    if (LW_METRICS_PATH) lw_metrics_use(LW_METRICS_PATH);
+
+    // Before the loops, they each register a ring with the writer
+    if (lw_access_log_start() < 0) return -1;
+
+    int worker_count = LW_WORKERS;
+    if (worker_count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 0 ? (int)cpus : 1;
     }
 
-    // Listen for connections
-    if (listen(lw_ctx.server_fd, 10) < 0) {
-        perror("[ERR] Listen failed");
-        close(lw_ctx.server_fd);
+    if (LW_SSL_ENABLED == 1) {
+        configure_ssl_sessions(ssl_ctx, worker_count);
+        configure_ssl_ktls(ssl_ctx);
+        lw_handshake_pool_start(LW_HANDSHAKE_WORKERS);
+    }
+
+    lw_worker_t *workers = calloc(worker_count, sizeof(*workers));
+    int *inherited = calloc(worker_count, sizeof(*inherited));
+    if (!workers || !inherited) {
+        perror("[ERR] Worker allocation failed");
+        free(workers);
+        free(inherited);
         return -1;
     }
 
-    // Get the reload pipe fd for select
-    int reload_pipe_fd = get_reload_pipe_fd();
+    // After an upgrade the listeners are already bound, and must stay open throughout
+    int inherited_count = lw_upgrade_inherit(port, inherited, worker_count);
 
-    while (1) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(lw_ctx.server_fd, &read_fds);
-        if (reload_pipe_fd != -1) {
-            FD_SET(reload_pipe_fd, &read_fds);
-        }
+    // Bind every listener up front so port errors surface before serving
+    int rc = -1;
+    int ready = 0;
+    for (; ready < worker_count; ready++) {
+        lw_worker_t *w = &workers[ready];
+        w->listen_fd = ready < inherited_count ? inherited[ready] : create_listener(port, 1);
+        if (w->listen_fd < 0) goto cleanup;
 
-        // Set timeout to 1 second to prevent blocking indefinitely
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+        if (lw_loop_init(&w->loop, ready, w->listen_fd) < 0) {
+            close(w->listen_fd);
+            goto cleanup;
+        }
+    }
+    lw_ctx.server_fd = workers[0].listen_fd;
 
-        int max_fd = lw_ctx.server_fd;
-        if (reload_pipe_fd > max_fd) max_fd = reload_pipe_fd;
+    printf("[LW] Starting %d worker%s\n", worker_count, worker_count == 1 ? "" : "s");
 
-        int ready = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-        if (ready < 0) {
-            if (errno == EINTR) continue;
-            perror("[ERR] Select failed");
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("[ERR] Could not create worker thread");
+            worker_count = i;
             break;
         }
+    }
 
-        // Check if reload signal was received
-        if (reload_pipe_fd != -1 && FD_ISSET(reload_pipe_fd, &read_fds)) {
-            char buf;
-            while (read(reload_pipe_fd, &buf, 1) > 0); // Clear the pipe
-            printf("[DEV] Reload signal received\n");
-        }
+    if (worker_count > 0) {
+        lw_upgrade_ready();
+        serve_signals(workers, worker_count);
+        rc = 0;
+    }
 
-        // Check for new connections
-        if (FD_ISSET(lw_ctx.server_fd, &read_fds)) {
-            int client_socket = accept(lw_ctx.server_fd,
-                                       (struct sockaddr *)&address,
-                                       (socklen_t *)&addr_len);
-            if (client_socket < 0) {
-                perror("[ERR] Accept failed");
-                continue;
-            }
-
-            SSL *client_ssl = NULL;
-
-            // Handle SSL connection if enabled
-            if (LW_SSL_ENABLED == 1) {
-                client_ssl = SSL_new(ssl_ctx);
-                if (!client_ssl) {
-                    fprintf(stderr, "[ERR] Failed to create SSL structure\n");
-                    close(client_socket);
-                    continue;
-                }
-
-                SSL_set_fd(client_ssl, client_socket);
-
-                // Perform SSL handshake
-                if (SSL_accept(client_ssl) <= 0) {
-                    fprintf(stderr, "[ERR] SSL handshake failed\n");
-                    ERR_print_errors_fp(stderr);
-                    SSL_free(client_ssl);
-                    close(client_socket);
-                    continue;
-                }
-            }
-
-            // Read request
-            memset(buffer, 0, BUFFER_SIZE);
-            size_t total = 0;
-            int bytes_read;
-
-            while (total < BUFFER_SIZE - 1) {
-            if (LW_SSL_ENABLED == 1 && client_ssl) {
-                bytes_read = SSL_read(client_ssl, buffer + total,BUFFER_SIZE - total - 1);
-            } else {
-                bytes_read = read(client_socket, buffer + total,BUFFER_SIZE - total - 1);
-            }
-
-            if (bytes_read <= 0) break;          /* EOF or error */
-            total += bytes_read;
-
-            if (total >= 4 &&
-                memcmp(buffer + total - 4, "\r\n\r\n", 4) == 0)
-                break;
-            }
-
-            if (total == 0) {
-                if (client_ssl) {
-                    SSL_shutdown(client_ssl);
-                    SSL_free(client_ssl);
-                }
-                close(client_socket);
-                continue;
-            }
-
-        buffer[total] = '\0';
-
-            // Get client IP
-            char ipstring[INET_ADDRSTRLEN];
-            getpeername(client_socket, (struct sockaddr *)&address, (socklen_t *)&addr_len);
-            struct sockaddr_in *s = (struct sockaddr_in *)&address;
-            inet_ntop(AF_INET, &s->sin_addr, ipstring, sizeof(ipstring));
-
-            if (strcmp(ipstring, "127.0.0.1") == 0) {
-                addr_len = sizeof(address);
-                getsockname(client_socket, (struct sockaddr *)&address, (socklen_t *)&addr_len);
-                inet_ntop(AF_INET, &s->sin_addr, ipstring, sizeof(ipstring));
-            }
-
-            LW_VERBOSE
-                ? printf("[LW] Incoming request:\nIP: %s\n%s\n", ipstring, buffer)
-                : printf("[LW] Incoming request: IP: %s\n", ipstring);
-
-            // Parse request
-            http_request_t request = {0};
-            parse_request(buffer, &request);
-
-            (LW_VERBOSE) ? printf("[INFO] Found %d headers\n", request.header_count) : -1;
-            for (int i = 0; i < request.header_count; ++i) {
-                (LW_VERBOSE) ? printf("[INFO] Header[%d]: \"%s\"\n", i, request.headers[i]) : -1;
-                const char *hdr = request.headers[i];
-                if (hdr && strncasecmp(hdr, "Accept-Encoding:", 16) == 0) {
-                    ACCEPT_ENCODING = hdr + 16;
-                    while (*ACCEPT_ENCODING == ' ' || *ACCEPT_ENCODING == '\t' || *ACCEPT_ENCODING == ':')
-                        ++ACCEPT_ENCODING;
-                    break;
-                }
-            }
-
-            // Find route
-            route_t *route = find_route(request.method, request.path);
-
-            http_response_t response = {0};
-            init_response(&response);
-            response.chunked_fd = (LW_DEV_MODE &&
-                       route && route->handler == index_handler)
-                          ? client_socket
-                          : -1;
-
-            if (route) {
-                route->handler(&request, &response);
-            } else {
-                // 404 Not Found
-                response.status_code = 404;
-                lw_set_header(&response, "Content-Type: text/plain");
-                lw_set_body(&response, "404 Not Found");
-            }
-
-            // Add reload header if needed
-            time_t now = time(NULL);
-            if (now - hot_reload_state.last_change_time <= 2) {
-                lw_set_header(&response, "X-Reload: 1");
-            }
-
-            // Send response
-            if (response.chunked_fd >= 0) {
-                // Chunked path keeps socket open for SSE //
-            } else {
-                lw_send_response(&response, client_socket, client_ssl, ACCEPT_ENCODING);
-                if (client_ssl) {
-                    SSL_shutdown(client_ssl);
-                    SSL_free(client_ssl);
-                }
-                close(client_socket);   // Only close non-chunked
-            }
-
-            // Cleanup request / response memory
-            free_request(&request);
-            free_response(&response);
-        }
+cleanup:
+    // Pool threads may still hold connections of these loops
+    lw_handshake_pool_stop();
+    for (int i = 0; i < ready; i++) {
+        lw_loop_close(&workers[i].loop);
+        close(workers[i].listen_fd);
     }
+    free(workers);
+    free(inherited);
 
-    close(lw_ctx.server_fd);
+    // Lines from the last requests are still queued
+    lw_access_log_stop();
 
     if (LW_SSL_ENABLED == 1) {
         SSL_CTX_free(ssl_ctx);
         cleanup_openssl();
     }
 
-    return 0;
+    return rc;
 }
 
-static void *redirect_worker(void *arg) {
-    (void)arg;
-
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+// Blocking, the redirector thread only ever waits in accept
+static int create_redirect_listener(void) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock < 0) {
         perror("[ERR] Redirect socket failed.\n");
-        return NULL;
+        return -1;
     }
 
     int opt = 1;
@@ -280,14 +253,20 @@ static void *redirect_worker(void *arg) {
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("[ERR] Redirect binding failed.\n");
         close(sock);
-        return NULL;
+        return -1;
     }
 
     if (listen(sock, 10) < 0) {
         perror("[ERR] Redirect listen failed.\n");
         close(sock);
-        return NULL;
+        return -1;
     }
+    return sock;
+}
+
+static void *redirect_worker(void *arg) {
+    (void)arg;
+    int sock = redirect_fd;
 
     printf("[REDIRECT] Redirect listener on http://localhost:%d\n", http_redirect_port);
 
@@ -311,8 +290,14 @@ static void *redirect_worker(void *arg) {
     return NULL;
 }
 
+/* Binds the HTTP redirect port on the calling thread, or takes it over
+ * from the process that started us, so an upgrade hands it on as well. */
 void start_redirector(void) {
     if (LW_SSL_ENABLED != 1) return;
+    if (lw_upgrade_inherit(http_redirect_port, &redirect_fd, 1) != 1)
+        redirect_fd = create_redirect_listener();
+    if (redirect_fd < 0) return;
+
     pthread_t tid;
     pthread_create(&tid, NULL, redirect_worker, NULL);
     pthread_detach(tid);
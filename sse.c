@@ -0,0 +1,270 @@
+#include "run.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+
+/* Server-Sent Events hub. Subscribers are streams parked on the loop that
+ * accepted them; lw_broadcast formats a message once and hands a reference
+ * to every loop that has subscribers, which then appends it to each
+ * matching stream. No thread per client, no lock on the fan-out path. */
+
+#define LW_SSE_CHANNEL_MAX 32
+
+/* Seconds between keep-alive comments; they also find dead peers. */
+#define LW_SSE_PING 15
+
+typedef struct {
+    int    refs;                /* one per loop it was queued to */
+    char   channel[LW_SSE_CHANNEL_MAX];
+    size_t len;
+    char   data[];              /* the event, framed and ready to send */
+} lw_sse_msg_t;
+
+typedef struct lw_sse_item {
+    lw_sse_msg_t *msg;
+    struct lw_sse_item *next;
+} lw_sse_item_t;
+
+typedef struct lw_sse_sub {
+    http_request_t *request;
+    lw_loop_t *loop;
+    char   channel[LW_SSE_CHANNEL_MAX];
+    int    lagging;             /* queue was full at the last event */
+    struct lw_sse_sub *prev, *next;
+} lw_sse_sub_t;
+
+// Every loop, so a broadcast from any thread reaches all of them
+static struct {
+    pthread_mutex_t mutex;
+    lw_loop_t *loops;           /* linked through sse_next */
+} hub = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void msg_unref(lw_sse_msg_t *msg) {
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) free(msg);
+}
+
+static void sub_unlink(lw_sse_sub_t *sub) {
+    lw_loop_t *loop = sub->loop;
+    if (sub->prev) sub->prev->next = sub->next;
+    else loop->sse_subs = sub->next;
+    if (sub->next) sub->next->prev = sub->prev;
+    __atomic_sub_fetch(&loop->sse_count, 1, __ATOMIC_RELAXED);
+    free(sub);
+}
+
+/* Called by the stream once the queue drained. Events are pushed by the
+ * hub, so there is never anything to produce here. */
+static void sse_produce(http_request_t *req, http_response_t *res, int events, void *arg) {
+    (void)req;
+    (void)res;
+    lw_sse_sub_t *sub = arg;
+    if (events & LW_WAIT_ERROR) sub_unlink(sub);
+    else sub->lagging = 0;
+}
+
+// Appends an event to one subscriber; one that cannot keep up is ended
+static void sse_send(lw_sse_sub_t *sub, const char *data, size_t len) {
+    http_request_t *req = sub->request;
+
+    if (sub->lagging) {
+        // EventSource reconnects by itself, and gets a fresh queue then
+        (LW_VERBOSE) ? printf("[LW] Dropping slow event subscriber\n") : 0;
+        lw_stream_end(req);
+        sub_unlink(sub);
+        lw_stream_wake(req);
+        return;
+    }
+
+    int rc = lw_stream_write(req, data, len);
+    if (rc > 0) sub->lagging = 1;
+    // Flushing, or a failed write, may close the connection, which
+    // unlinks and frees sub
+    lw_stream_wake(req);
+}
+
+/* Turns the request into an event stream of channel. Call from a handler,
+ * which then returns as usual. */
+int lw_sse_subscribe(http_request_t *request, http_response_t *response, const char *channel) {
+    if (!request->conn || strlen(channel) >= LW_SSE_CHANNEL_MAX) return -1;
+
+    lw_sse_sub_t *sub = calloc(1, sizeof(*sub));
+    if (!sub) return -1;
+    if (lw_stream_begin(request, response, sse_produce, sub) < 0) {
+        free(sub);
+        return -1;
+    }
+
+    lw_loop_t *loop = request->conn->loop;
+    sub->request = request;
+    sub->loop = loop;
+    strcpy(sub->channel, channel);
+    sub->next = loop->sse_subs;
+    if (sub->next) sub->next->prev = sub;
+    loop->sse_subs = sub;
+    __atomic_add_fetch(&loop->sse_count, 1, __ATOMIC_RELAXED);
+
+    lw_set_header(response, "Content-Type: text/event-stream");
+    lw_set_header(response, "Cache-Control: no-cache");
+    return 0;
+}
+
+/* Sends data as one event to every subscriber of channel, on every loop.
+ * Safe from any thread; delivery happens on the loops right after. */
+int lw_broadcast(const char *channel, const char *data) {
+    if (strlen(channel) >= LW_SSE_CHANNEL_MAX) return -1;
+
+    // Each line of data needs its own "data: " field
+    size_t len = 1;
+    for (const char *p = data;; p++) {
+        len += 7;
+        const char *end = strchr(p, '\n');
+        if (!end) {
+            len += strlen(p);
+            break;
+        }
+        len += end - p;
+        p = end;
+    }
+
+    lw_sse_msg_t *msg = malloc(sizeof(*msg) + len + 1);
+    if (!msg) return -1;
+    strcpy(msg->channel, channel);
+    msg->len = 0;
+    for (const char *p = data;; p++) {
+        size_t line = strcspn(p, "\n");
+        msg->len += sprintf(msg->data + msg->len, "data: %.*s\n", (int)line, p);
+        p += line;
+        if (!*p) break;
+    }
+    msg->data[msg->len++] = '\n';
+    msg->refs = 1;      // ours, until every loop has its own
+
+    int delivered = 0;
+    pthread_mutex_lock(&hub.mutex);
+    for (lw_loop_t *loop = hub.loops; loop; loop = loop->sse_next) {
+        if (__atomic_load_n(&loop->sse_count, __ATOMIC_RELAXED) == 0) continue;
+
+        lw_sse_item_t *item = malloc(sizeof(*item));
+        if (!item) continue;
+        item->msg = msg;
+        item->next = NULL;
+        __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&loop->sse_mutex);
+        if (loop->sse_tail) loop->sse_tail->next = item;
+        else loop->sse_inbox = item;
+        loop->sse_tail = item;
+        pthread_mutex_unlock(&loop->sse_mutex);
+
+        uint64_t one = 1;
+        while (write(loop->sse_wake.fd, &one, sizeof(one)) < 0 && errno == EINTR);
+        delivered++;
+    }
+    pthread_mutex_unlock(&hub.mutex);
+
+    msg_unref(msg);
+    return delivered;
+}
+
+// Fans out whatever lw_broadcast queued for this loop
+void lw_sse_deliver(lw_loop_t *loop) {
+    uint64_t count;
+    while (read(loop->sse_wake.fd, &count, sizeof(count)) > 0);
+
+    pthread_mutex_lock(&loop->sse_mutex);
+    lw_sse_item_t *item = loop->sse_inbox;
+    loop->sse_inbox = loop->sse_tail = NULL;
+    pthread_mutex_unlock(&loop->sse_mutex);
+
+    while (item) {
+        lw_sse_item_t *next = item->next;
+        lw_sse_msg_t *msg = item->msg;
+
+        lw_sse_sub_t *sub = loop->sse_subs;
+        while (sub) {
+            lw_sse_sub_t *sub_next = sub->next;
+            if (strcmp(sub->channel, msg->channel) == 0)
+                sse_send(sub, msg->data, msg->len);
+            sub = sub_next;
+        }
+
+        msg_unref(msg);
+        free(item);
+        item = next;
+    }
+}
+
+// Comments keep proxies from timing the stream out and expose dead peers
+void lw_sse_tick(lw_loop_t *loop) {
+    if (!loop->sse_subs || loop->now - loop->sse_last_ping < LW_SSE_PING) return;
+    loop->sse_last_ping = loop->now;
+
+    lw_sse_sub_t *sub = loop->sse_subs;
+    while (sub) {
+        lw_sse_sub_t *next = sub->next;
+        sse_send(sub, ": ping\n\n", 8);
+        sub = next;
+    }
+}
+
+/* Ends every stream on a loop that is shutting down; EventSource clients
+ * reconnect, to whichever process is accepting by then. */
+void lw_sse_drain(lw_loop_t *loop) {
+    lw_sse_sub_t *sub = loop->sse_subs;
+    while (sub) {
+        lw_sse_sub_t *next = sub->next;
+        http_request_t *req = sub->request;
+        lw_stream_end(req);
+        sub_unlink(sub);
+        lw_stream_wake(req);
+        sub = next;
+    }
+}
+
+int lw_sse_loop_init(lw_loop_t *loop) {
+    loop->sse_wake.kind = LW_EV_BROADCAST;
+    loop->sse_wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->sse_wake.fd < 0) {
+        perror("[ERR] eventfd failed");
+        return -1;
+    }
+    pthread_mutex_init(&loop->sse_mutex, NULL);
+    loop->sse_last_ping = loop->now;
+
+    pthread_mutex_lock(&hub.mutex);
+    loop->sse_next = hub.loops;
+    hub.loops = loop;
+    pthread_mutex_unlock(&hub.mutex);
+    return 0;
+}
+
+void lw_sse_loop_close(lw_loop_t *loop) {
+    pthread_mutex_lock(&hub.mutex);
+    for (lw_loop_t **p = &hub.loops; *p; p = &(*p)->sse_next) {
+        if (*p == loop) {
+            *p = loop->sse_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hub.mutex);
+
+    while (loop->sse_inbox) {
+        lw_sse_item_t *next = loop->sse_inbox->next;
+        msg_unref(loop->sse_inbox->msg);
+        free(loop->sse_inbox);
+        loop->sse_inbox = next;
+    }
+    if (loop->sse_wake.fd >= 0) close(loop->sse_wake.fd);
+    loop->sse_wake.fd = -1;
+}
+
+static void reload_events(http_request_t *req, http_response_t *res) {
+    if (lw_sse_subscribe(req, res, LW_RELOAD_CHANNEL) < 0) {
+        res->status_code = 500;
+        lw_set_body(res, "Could not subscribe");
+    }
+}
+
+/* Dev mode: pages listen on LW_RELOAD_PATH and reload on every event. */
+void lw_sse_use_reload(void) {
+    lw_route(GET, LW_RELOAD_PATH, reload_events);
+}
@@ -0,0 +1,108 @@
+#include "run.h"
+
+/* Hierarchical timer wheel. Level 0 has a slot per tick for the next
+ * LW_WHEEL_SIZE ticks, each level above covers LW_WHEEL_SIZE times the
+ * span of the one below with slots just as coarse. Arming and cancelling
+ * are a list insert or unlink; a level's slot is spread over the level
+ * below when the wheel reaches it, so each timer moves at most once per
+ * level. Timers that are due wait in `due` until lw_wheel_next hands them
+ * out one at a time, so expiring one may safely re-arm or cancel another. */
+
+#define LW_WHEEL_MASK (LW_WHEEL_SIZE - 1)
+
+static void list_push(lw_timer_t **head, lw_timer_t *t) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void wheel_place(lw_wheel_t *w, lw_timer_t *t) {
+    if (t->expires <= w->now) {
+        list_push(&w->due, t);
+        return;
+    }
+
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < LW_WHEEL_LEVELS - 1 && delta >= 1ull << (LW_WHEEL_BITS * (level + 1)))
+        level++;
+
+    // Beyond the top level: parked in its farthest slot, re-placed when reached
+    uint64_t at = t->expires;
+    uint64_t span = 1ull << (LW_WHEEL_BITS * LW_WHEEL_LEVELS);
+    if (delta >= span) at = w->now + span - 1;
+
+    int slot = (at >> (LW_WHEEL_BITS * level)) & LW_WHEEL_MASK;
+    list_push(&w->slots[level][slot], t);
+}
+
+void lw_wheel_init(lw_wheel_t *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+void lw_timer_cancel(lw_wheel_t *w, lw_timer_t *t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    w->count--;
+}
+
+// Fires once the wheel reaches expires; re-arming an armed timer moves it
+void lw_timer_arm(lw_wheel_t *w, lw_timer_t *t, uint64_t expires) {
+    lw_timer_cancel(w, t);
+    t->expires = expires;
+    wheel_place(w, t);
+    w->count++;
+}
+
+// Spreads one slot of level over the levels below
+static void wheel_cascade(lw_wheel_t *w, int level, int slot) {
+    lw_timer_t *t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    while (t) {
+        lw_timer_t *next = t->next;
+        wheel_place(w, t);
+        t = next;
+    }
+}
+
+/* Moves the wheel up to now and returns the next due timer, already
+ * disarmed, or NULL once none is left. */
+lw_timer_t *lw_wheel_next(lw_wheel_t *w, uint64_t now) {
+    // Nothing to move through, just catch up
+    if (w->count == 0) {
+        if (now > w->now) w->now = now;
+        return NULL;
+    }
+
+    while (!w->due && w->now < now) {
+        w->now++;
+        int slot = w->now & LW_WHEEL_MASK;
+
+        // Higher levels first, their timers may land in this very slot
+        if (slot == 0) {
+            int level = 1;
+            while (level < LW_WHEEL_LEVELS - 1 &&
+                   ((w->now >> (LW_WHEEL_BITS * level)) & LW_WHEEL_MASK) == 0)
+                level++;
+            for (; level >= 1; level--)
+                wheel_cascade(w, level, (w->now >> (LW_WHEEL_BITS * level)) & LW_WHEEL_MASK);
+        }
+
+        lw_timer_t *t = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        while (t) {
+            lw_timer_t *next = t->next;
+            list_push(&w->due, t);
+            t = next;
+        }
+    }
+
+    lw_timer_t *t = w->due;
+    if (t) lw_timer_cancel(w, t);
+    return t;
+}
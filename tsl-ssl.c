@@ -3,6 +3,8 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
 
 #define PORT 8443
 
@@ -60,7 +62,208 @@ void configure_ssl_ctx(SSL_CTX *ctx, const char* cert_file, const char* key_file
         if (LW_DEV_MODE == 1) printf("[DEV] Private key and public certificate key matches.\n"); 
     }
 
+    /* A second, ECDSA certificate next to an RSA one. OpenSSL keeps one
+     * per key type and signs with ECDSA for every client that offers it,
+     * which is far cheaper than an RSA signature per handshake. */
+    if (LW_EC_CERT_FILE && LW_EC_KEY_FILE) {
+        if (SSL_CTX_use_certificate_chain_file(ctx, LW_EC_CERT_FILE) <= 0 ||
+            SSL_CTX_use_PrivateKey_file(ctx, LW_EC_KEY_FILE, SSL_FILETYPE_PEM) <= 0 ||
+            !SSL_CTX_check_private_key(ctx)) {
+            printf("[ERR] Unable to load ECDSA certificate, serving the primary one only\n");
+            ERR_print_errors_fp(stderr);
+        } else {
+            printf("[LW] ECDSA certificate loaded: %s\n", LW_EC_CERT_FILE);
+        }
+    }
+
     // Setting the security levels and cipher preferences.
     SSL_CTX_set_security_level(ctx, LW_SSL_SECLVL);
     SSL_CTX_set_cipher_list(ctx, "HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!MD4");
 }
+
+/* Stateless tickets are sealed with the current key; the previous one is
+ * kept so tickets issued just before a rotation still resume. */
+typedef struct {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;
+    int    valid;
+} ticket_key_t;
+
+static struct {
+    ticket_key_t keys[2];   /* [0] current, [1] previous */
+    pthread_mutex_t mutex;
+} tickets = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static struct {
+    unsigned long full;
+    unsigned long resumed;
+} tls_stats;
+
+static int ticket_key_new(ticket_key_t *key, time_t now) {
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1) {
+        key->valid = 0;
+        return -1;
+    }
+    key->created = now;
+    key->valid = 1;
+    return 0;
+}
+
+// Called with tickets.mutex held
+static void ticket_rotate(time_t now) {
+    if (tickets.keys[0].valid && now - tickets.keys[0].created < LW_TLS_TICKET_ROTATE)
+        return;
+    tickets.keys[1] = tickets.keys[0];
+    if (ticket_key_new(&tickets.keys[0], now) == 0 && tickets.keys[1].valid && LW_VERBOSE)
+        printf("[TLS] Session ticket key rotated\n");
+}
+
+static int ticket_mac_init(EVP_MAC_CTX *hctx, unsigned char *hmac_key) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac_key, 32),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+/* Returns 1 to use the key, 2 when the ticket should be reissued under
+ * the current key, 0 when the ticket's key is gone, -1 on error. */
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+    (void)ssl;
+    ticket_key_t key;
+    int slot = -1;
+
+    pthread_mutex_lock(&tickets.mutex);
+    ticket_rotate(time(NULL));
+    if (enc) {
+        slot = tickets.keys[0].valid ? 0 : -1;
+    } else {
+        for (int i = 0; i < 2 && slot < 0; i++)
+            if (tickets.keys[i].valid && memcmp(tickets.keys[i].name, key_name, 16) == 0)
+                slot = i;
+    }
+    if (slot >= 0) key = tickets.keys[slot];
+    pthread_mutex_unlock(&tickets.mutex);
+
+    if (slot < 0) return enc ? -1 : 0;
+
+    if (enc) {
+        memcpy(key_name, key.name, 16);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+        if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) return -1;
+    } else if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) {
+        return -1;
+    }
+    if (!ticket_mac_init(hctx, key.hmac_key)) return -1;
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return slot == 0 ? 1 : 2;
+}
+
+/* Resumption, so returning clients skip the key exchange. The context is
+ * shared by every worker, so one server-side cache serves them all and is
+ * sized for the lot. TLS 1.3 resumes through PSK tickets: stateless when
+ * ticket keys are enabled, otherwise looked up in that same cache. */
+void configure_ssl_sessions(SSL_CTX *ctx, int workers) {
+    static const unsigned char sid_ctx[] = "lower";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+
+    long cache_size = LW_TLS_SESSION_CACHE * (workers > 0 ? workers : 1);
+    if (LW_TLS_SESSION_CACHE > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (LW_TLS_TICKET_ROTATE > 0) {
+        // A ticket must not outlive the keys that can open it
+        SSL_CTX_set_timeout(ctx, LW_TLS_TICKET_ROTATE);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+        SSL_CTX_set_num_tickets(ctx, 2);
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(ctx, LW_TLS_SESSION_CACHE > 0 ? 1 : 0);
+    }
+
+    printf("[LW] TLS resumption: session cache %s, tickets %s\n",
+           LW_TLS_SESSION_CACHE > 0 ? "on" : "off",
+           LW_TLS_TICKET_ROTATE > 0 ? "on" : "off");
+}
+
+/* Opt-in kernel TLS: once the handshake is done OpenSSL hands the keys
+ * to the kernel and file bodies go out with SSL_sendfile. Connections
+ * whose cipher or kernel can't do it stay in userspace on their own. */
+void configure_ssl_ktls(SSL_CTX *ctx) {
+    if (!LW_KTLS) {
+        printf("[LW] TLS mode: userspace\n");
+        return;
+    }
+
+#ifdef OPENSSL_NO_KTLS
+    (void)ctx;
+    printf("[LW] TLS mode: userspace (OpenSSL built without kTLS)\n");
+#else
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // The tls module loads on first use, so absent here is only a hint
+    if (access("/sys/module/tls", F_OK) == 0)
+        printf("[LW] TLS mode: kernel (kTLS), userspace fallback per connection\n");
+    else
+        printf("[LW] TLS mode: kernel (kTLS) requested, tls module not loaded yet; "
+               "connections fall back to userspace if it is unavailable\n");
+#endif
+}
+
+/* One non-blocking SSL_accept step. Returns 1 when the handshake is done,
+ * 0 when it needs more I/O, -1 on failure. Must run on the thread that
+ * inspects the result, since OpenSSL's error queue is per thread. */
+int lw_tls_accept(SSL *ssl) {
+    int rc = SSL_accept(ssl);
+    if (rc == 1) return 1;
+
+    int err = SSL_get_error(ssl, rc);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+
+    fprintf(stderr, "[ERR] SSL handshake failed\n");
+    ERR_print_errors_fp(stderr);
+    return -1;
+}
+
+// Whether this connection's writes are encrypted by the kernel
+int lw_tls_ktls_send(SSL *ssl) {
+    static int reported;
+    if (!LW_KTLS) return 0;
+
+    int ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    if (!__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED))
+        printf("[TLS] %s\n", ktls ? "kTLS active, HTTPS file bodies use sendfile"
+                                   : "kTLS unavailable for this connection, using userspace TLS");
+    return ktls;
+}
+
+// Counts one completed handshake toward the resumption hit rate
+void lw_tls_handshake_done(SSL *ssl) {
+    int resumed = SSL_session_reused(ssl);
+    unsigned long hits = resumed
+        ? __atomic_add_fetch(&tls_stats.resumed, 1, __ATOMIC_RELAXED)
+        : __atomic_load_n(&tls_stats.resumed, __ATOMIC_RELAXED);
+    unsigned long full = resumed
+        ? __atomic_load_n(&tls_stats.full, __ATOMIC_RELAXED)
+        : __atomic_add_fetch(&tls_stats.full, 1, __ATOMIC_RELAXED);
+
+    if (LW_VERBOSE)
+        printf("[TLS] %s handshake, resumed %lu of %lu (%.1f%%)\n",
+               resumed ? "Resumed" : "Full", hits, hits + full,
+               100.0 * hits / (hits + full));
+}
+
+void lw_tls_stats(unsigned long *full, unsigned long *resumed) {
+    *full = __atomic_load_n(&tls_stats.full, __ATOMIC_RELAXED);
+    *resumed = __atomic_load_n(&tls_stats.resumed, __ATOMIC_RELAXED);
+}
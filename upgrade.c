@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "run.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* Binary upgrade. On SIGUSR2 the running server re-executes its own
+ * command line; the new process inherits the bound listeners as plain
+ * file descriptors, named in LW_LISTEN_FDS, so the port never closes.
+ * Each listener is claimed by the part of the server that uses its port,
+ * the workers or the HTTPS redirector.
+ * Once its workers run it writes a byte to the LW_UPGRADE_FD pipe and the
+ * old process drains. A new binary that fails to start is killed and the
+ * old one keeps serving. */
+
+// How long a new process gets to signal that it serves
+#define LW_UPGRADE_WAIT_MS 10000
+
+char **LW_ARGV = NULL;
+
+/* Signals are taken by lw_run's main thread with sigwait, so every other
+ * thread must have them blocked. Call before starting any thread. */
+void lw_block_signals(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+// Still cleared for exec: handed over but not claimed yet
+static int unclaimed(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    return flags >= 0 && !(flags & FD_CLOEXEC);
+}
+
+static int bound_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0 || addr.sin_family != AF_INET)
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+/* Fills fds with the listeners on port handed over by a previous process
+ * and returns how many there are; 0 on a normal start. Listeners beyond
+ * max are closed, the kernel would otherwise queue connections nobody
+ * takes. */
+int lw_upgrade_inherit(int port, int *fds, int max) {
+    const char *list = getenv("LW_LISTEN_FDS");
+    if (!list) return 0;
+
+    int count = 0;
+    char *end;
+    for (const char *p = list; *p; p = *end ? end + 1 : end) {
+        long fd = strtol(p, &end, 10);
+        if (end == p) break;
+        if (fd < 0 || fd > INT_MAX || !unclaimed(fd) || bound_port(fd) != port) continue;
+
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening) {
+            fprintf(stderr, "[ERR] Inherited fd %ld is not a listening socket\n", fd);
+            continue;
+        }
+        if (count == max) {
+            close(fd);
+            continue;
+        }
+        // Cleared for exec, restored so our own children do not get it
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fds[count++] = (int)fd;
+    }
+
+    printf("[LW] Inherited %d listener%s on port %d from the previous process\n",
+           count, count == 1 ? "" : "s", port);
+    return count;
+}
+
+/* Tells the process that started us that we are serving. Listeners it
+ * handed over that nothing here claimed are closed. */
+void lw_upgrade_ready(void) {
+    const char *list = getenv("LW_LISTEN_FDS");
+    if (list) {
+        char *end;
+        for (const char *p = list; *p; p = *end ? end + 1 : end) {
+            long fd = strtol(p, &end, 10);
+            if (end == p) break;
+            if (fd >= 0 && fd <= INT_MAX && unclaimed(fd)) close(fd);
+        }
+        unsetenv("LW_LISTEN_FDS");
+    }
+
+    const char *env = getenv("LW_UPGRADE_FD");
+    if (!env) return;
+
+    int fd = atoi(env);
+    unsetenv("LW_UPGRADE_FD");
+    char ok = 1;
+    while (write(fd, &ok, 1) < 0 && errno == EINTR);
+    close(fd);
+}
+
+// envp with LW_LISTEN_FDS and LW_UPGRADE_FD replaced; freed with free_env
+static char **build_env(const char *fds, int ready_fd) {
+    extern char **environ;
+    size_t n = 0;
+    while (environ[n]) n++;
+
+    char **envp = calloc(n + 3, sizeof(*envp));
+    if (!envp) return NULL;
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], "LW_LISTEN_FDS=", 14) == 0 ||
+            strncmp(environ[i], "LW_UPGRADE_FD=", 14) == 0)
+            continue;
+        envp[k++] = environ[i];
+    }
+
+    // Sized from fds itself, so the list is never cut short
+    size_t len = strlen(fds);
+    envp[k] = malloc(14 + len + 1);
+    envp[k + 1] = malloc(32);
+    if (!envp[k] || !envp[k + 1]) {
+        free(envp[k]);
+        free(envp[k + 1]);
+        free(envp);
+        return NULL;
+    }
+    memcpy(envp[k], "LW_LISTEN_FDS=", 14);
+    memcpy(envp[k] + 14, fds, len + 1);
+    snprintf(envp[k + 1], 32, "LW_UPGRADE_FD=%d", ready_fd);
+    return envp;
+}
+
+/* Finds the file execvp would run for name, here rather than in the
+ * child: after fork only async-signal-safe calls are allowed. */
+static int resolve_binary(const char *name, char *path, size_t size) {
+    if (strchr(name, '/')) {
+        if (strlen(name) >= size) return -1;
+        strcpy(path, name);
+        return 0;
+    }
+
+    const char *dirs = getenv("PATH");
+    if (!dirs) dirs = "/bin:/usr/bin";
+    for (const char *dir = dirs; ; dir++) {
+        size_t len = strcspn(dir, ":");
+        // An empty entry means the current directory
+        int n = len ? snprintf(path, size, "%.*s/%s", (int)len, dir, name)
+                    : snprintf(path, size, "%s", name);
+        if (n > 0 && (size_t)n < size && access(path, X_OK) == 0) return 0;
+        dir += len;
+        if (!*dir) break;
+    }
+    return -1;
+}
+
+static void free_env(char **envp) {
+    size_t k = 0;
+    while (envp[k]) k++;
+    free(envp[k - 2]);
+    free(envp[k - 1]);
+    free(envp);
+}
+
+/* Starts a new copy of the server on the same listeners and waits until
+ * it serves. Returns 0 when it does, -1 when this process should carry
+ * on as if nothing happened. */
+int lw_upgrade_spawn(const int *listen_fds, int count) {
+    if (!LW_ARGV || !LW_ARGV[0]) return -1;
+
+    // Every fd as text, so the child needs no allocation before exec
+    char fds[count * 12 + 1];
+    size_t len = 0;
+    fds[0] = '\0';
+    for (int i = 0; i < count; i++)
+        len += snprintf(fds + len, sizeof(fds) - len, i ? ",%d" : "%d", listen_fds[i]);
+
+    char binary[PATH_MAX];
+    if (resolve_binary(LW_ARGV[0], binary, sizeof(binary)) < 0) {
+        fprintf(stderr, "[ERR] Upgrade: %s not found\n", LW_ARGV[0]);
+        return -1;
+    }
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("[ERR] Upgrade pipe failed");
+        return -1;
+    }
+
+    char **envp = build_env(fds, pipefd[1]);
+    if (!envp) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    // Our signals are blocked for sigwait; the new binary starts clean
+    sigset_t none;
+    sigemptyset(&none);
+
+    // Everything the child needs is ready, it only makes syscalls
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        for (int i = 0; i < count; i++) fcntl(listen_fds[i], F_SETFD, 0);
+        fcntl(pipefd[1], F_SETFD, 0);
+        execve(binary, LW_ARGV, envp);
+        _exit(127);
+    }
+    free_env(envp);
+    close(pipefd[1]);
+
+    if (pid < 0) {
+        perror("[ERR] Upgrade fork failed");
+        close(pipefd[0]);
+        return -1;
+    }
+
+    printf("[LW] Started new process %d, waiting for it to serve\n", (int)pid);
+
+    // A byte means it serves; EOF means it exited or failed to exec
+    struct pollfd pfd = { .fd = pipefd[0], .events = POLLIN };
+    char ok = 0;
+    int rc = poll(&pfd, 1, LW_UPGRADE_WAIT_MS);
+    if (rc > 0 && read(pipefd[0], &ok, 1) == 1 && ok == 1) {
+        close(pipefd[0]);
+        return 0;
+    }
+    close(pipefd[0]);
+
+    if (rc == 0) {
+        fprintf(stderr, "[ERR] New process %d did not start in time\n", (int)pid);
+        kill(pid, SIGKILL);
+    } else {
+        fprintf(stderr, "[ERR] New process %d failed to start\n", (int)pid);
+    }
+    waitpid(pid, NULL, 0);
+    return -1;
+}
@@ -4,11 +4,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
-
-chunked_state_t chunked_state = {
-    .chunked_count = 0,
-    .chunked_mutex = PTHREAD_MUTEX_INITIALIZER
-};
+#include <stdarg.h>
 
 const char *method_to_string(http_method_t method)
 {
@@ -33,22 +29,44 @@ const char *method_to_string(http_method_t method)
     }
 }
 
-route_t *find_route(http_method_t method, const char *path)
-{
-    for (int i = 0; i < lw_ctx.route_count; i++)
-    {
-        route_t *route = &lw_ctx.routes[i];
-        if (route->method == method)
-        {
-            size_t route_len = strlen(route->path);
+int lw_buf_reserve(lw_buf_t *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
 
-            if (strncmp(route->path, path, route_len) == 0)
-            {
-                return route;
-            }
-        }
-    }
-    return NULL;
+    size_t cap = buf->cap ? buf->cap : BUFFER_SIZE;
+    while (cap < buf->len + extra) cap *= 2;
+
+    char *data = realloc(buf->data, cap);
+    if (!data) return -1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+int lw_buf_append(lw_buf_t *buf, const void *data, size_t len) {
+    if (lw_buf_reserve(buf, len) < 0) return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+int lw_buf_printf(lw_buf_t *buf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || lw_buf_reserve(buf, (size_t)n + 1) < 0) return -1;
+
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    buf->len += n;
+    return n;
+}
+
+void lw_buf_free(lw_buf_t *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
 }
 
 int match_option(const char *arg, const char *short_opt, const char *long_opt) {
@@ -57,6 +75,9 @@ int match_option(const char *arg, const char *short_opt, const char *long_opt) {
 
 int parameter_controller(int argc, char *argv[])
 {
+    // Re-executed as is on SIGUSR2
+    LW_ARGV = argv;
+
     for (int i = 1;i < argc;i++) {
         if (match_option(argv[i], "-h", "--help")) {
             print_help();
@@ -95,6 +116,126 @@ int parameter_controller(int argc, char *argv[])
             LW_KEY = 1;
         } else if (match_option(argv[i], "-c", "--compress")) {
             LW_COMPRESS = 1;
+        } else if (match_option(argv[i], "-w", "--workers")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_WORKERS = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-ka", "--keepalive")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_KEEPALIVE_TIMEOUT = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-km", "--keepalive-max")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_KEEPALIVE_MAX = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-mb", "--max-body")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_MAX_BODY_SIZE = atol(argv[++i]);
+        } else if (match_option(argv[i], "-cs", "--cache-size")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_CACHE_SIZE = atol(argv[++i]);
+        } else if (match_option(argv[i], "-sc", "--session-cache")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_TLS_SESSION_CACHE = atol(argv[++i]);
+        } else if (match_option(argv[i], "-tk", "--ticket-rotate")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_TLS_TICKET_ROTATE = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-kt", "--ktls")) {
+            LW_KTLS = 1;
+        } else if (match_option(argv[i], "-ht", "--handshake-timeout")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_TLS_HANDSHAKE_TIMEOUT = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-hw", "--handshake-workers")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_HANDSHAKE_WORKERS = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-hd", "--header-timeout")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_HEADER_TIMEOUT = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-bt", "--body-timeout")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_BODY_TIMEOUT = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-wt", "--write-timeout")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_WRITE_TIMEOUT = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-pi", "--per-ip")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_MAX_PER_IP = atoi(argv[++i]);
+        } else if (match_option(argv[i], "-ec", "--ec-certificate")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_EC_CERT_FILE = argv[++i];
+        } else if (match_option(argv[i], "-ek", "--ec-private-key")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_EC_KEY_FILE = argv[++i];
+        } else if (match_option(argv[i], "-mt", "--metrics")) {
+            if (i + 1 >= argc || argv[i + 1][0] != '/') {
+                fprintf(stderr, "[ERR] %s requires a path such as /__lw/metrics\n", argv[i]);
+                return -1;
+            }
+            LW_METRICS_PATH = argv[++i];
+        } else if (match_option(argv[i], "-al", "--access-log")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a file, - or off\n", argv[i]);
+                return -1;
+            }
+            LW_ACCESS_LOG = argv[++i];
+        } else if (match_option(argv[i], "-lf", "--log-format")) {
+            const char *format = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(format, "common") == 0) {
+                LW_LOG_FORMAT = LW_LOG_COMMON;
+            } else if (strcmp(format, "json") == 0) {
+                LW_LOG_FORMAT = LW_LOG_JSON;
+            } else {
+                fprintf(stderr, "[ERR] --log-format is common or json\n");
+                return -1;
+            }
+        } else if (match_option(argv[i], "-dt", "--drain-timeout")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[ERR] %s requires a value\n", argv[i]);
+                return -1;
+            }
+            LW_DRAIN_TIMEOUT = atoi(argv[++i]);
         }
     } 
 
@@ -131,6 +272,26 @@ void print_help()
     printf("  -ck, --certificate-key   Certificate file for HTTPS/TLS (requires -pk)\n");
     printf("  -pk, --private-key      Private key file for HTTPS/TLS (requires -ck)\n");
     printf("  -c, --compress          Enable compression\n");
+    printf("  -w, --workers <n>       Worker threads (default: one per CPU)\n");
+    printf("  -ka, --keepalive <sec>  Idle keep-alive timeout, 0 disables (default: 5)\n");
+    printf("  -km, --keepalive-max <n> Requests per connection (default: 100)\n");
+    printf("  -mb, --max-body <bytes> Largest buffered request body (default: 8 MiB)\n");
+    printf("  -cs, --cache-size <bytes> Static file cache budget, 0 disables (default: 64 MiB)\n");
+    printf("  -sc, --session-cache <n> TLS sessions cached per worker, 0 disables (default: 4096)\n");
+    printf("  -tk, --ticket-rotate <sec> TLS ticket key lifetime, 0 disables tickets (default: 3600)\n");
+    printf("  -kt, --ktls             Kernel TLS, lets HTTPS use sendfile (falls back if unsupported)\n");
+    printf("  -ec, --ec-certificate   Additional ECDSA certificate, served to clients that support it\n");
+    printf("  -ek, --ec-private-key   Private key for -ec\n");
+    printf("  -ht, --handshake-timeout <sec> Time allowed for a TLS handshake (default: 10)\n");
+    printf("  -hw, --handshake-workers <n> Threads doing TLS handshakes, 0 runs them on the loops (default: 0)\n");
+    printf("  -hd, --header-timeout <sec> Time to send a whole request head (default: 10)\n");
+    printf("  -bt, --body-timeout <sec> Longest pause while sending a request body (default: 30)\n");
+    printf("  -wt, --write-timeout <sec> Longest pause while reading a response (default: 30)\n");
+    printf("  -pi, --per-ip <n>       Open connections allowed per client address, 0 for no cap (default: 0)\n");
+    printf("  -mt, --metrics <path>   Serve Prometheus metrics at path, e.g. /__lw/metrics (default: off)\n");
+    printf("  -al, --access-log <f>   Access log file, - for stdout or off (default: -)\n");
+    printf("  -lf, --log-format <f>   Access log format, common or json (default: common)\n");
+    printf("  -dt, --drain-timeout <sec> Time open requests get on SIGTERM or upgrade (default: 30)\n");
     printf("  -h, --help              Show this help message\n");
     printf("\nExamples:\n");
     printf("  ./lwserver -d                    # Start in development mode\n");